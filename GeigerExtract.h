@@ -0,0 +1,79 @@
+/*
+	Title: Extraction steps of the Geiger Counter Random Number Generator
+
+	The ways GeigerRNG.c turns Geiger timing into bits, written once so that the host tools
+	(host/include/geiger/extract.hpp) use exactly the firmware's logic:
+
+	- gx_compare: the HotBits comparison of two intervals, 1 if the second is longer.
+	  gx_compare_tie does the same but reports a tie, so the caller can discard it.
+	- gx_von_neumann: a pair of bits to one unbiased bit, or nothing.
+	- gx_fold: the parity of every k bits, PARITY_FOLD.
+	- gx_low_bit: bit i of an interval, for taking the low bits of each interval (ADAPT).
+
+	The bits of a byte are collected LSB first, and the full byte is XORed with GX_FLIP.
+
+	Everything is static inline, uses only fixed size integers and has no branches other than
+	the ones the method needs, so it costs nothing over the hand written code on the AVR. Any
+	state lives in the caller's variables. Functions that may or may not produce a bit return
+	GX_NONE when they don't.
+
+	This file is C99 and C++ compatible.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#ifndef GEIGER_EXTRACT_H
+#define GEIGER_EXTRACT_H
+
+#include <stdint.h>
+
+#define GX_NONE		0xff	// no bit this time
+#define GX_FLIP		0xaa	// every other bit of a byte is flipped, see push_bit() in GeigerRNG.c
+
+// 1 if interval b is longer than interval a, else 0. Ties give 0, as the firmware always has.
+static inline uint8_t gx_compare(uint32_t a, uint32_t b)
+{
+	return b > a;
+}
+
+// 1 if interval b is longer than interval a, 0 if shorter, GX_NONE for a tie
+static inline uint8_t gx_compare_tie(uint32_t a, uint32_t b)
+{
+	if (a == b)
+		return GX_NONE;
+	return b > a;
+}
+
+// Von Neumann's extractor: 01 gives 0, 10 gives 1, 00 and 11 give GX_NONE
+static inline uint8_t gx_von_neumann(uint8_t first, uint8_t second)
+{
+	if (first == second)
+		return GX_NONE;
+	return first;
+}
+
+// Fold bit into the running parity *acc of *n bits. Every k bits the parity comes out and the
+// state starts over, otherwise GX_NONE.
+static inline uint8_t gx_fold(uint8_t *acc, uint8_t *n, uint8_t bit, uint8_t k)
+{
+	uint8_t parity = *acc ^ bit;
+
+	if (++*n < k) {
+		*acc = parity;
+		return GX_NONE;
+	}
+	*acc = 0;
+	*n = 0;
+	return parity;
+}
+
+// Bit i of an interval
+static inline uint8_t gx_low_bit(uint32_t interval, uint8_t i)
+{
+	return (uint8_t)(interval >> i) & 1;
+}
+
+#endif
@@ -204,17 +204,82 @@
 
 // Includes
 #include <avr/io.h>			// this contains the AVR IO port definitions
+#include <avr/eeprom.h>		// settings kept in EEPROM
 #include <avr/interrupt.h>	// interrupt service routines
 #include <avr/pgmspace.h>	// tools used to store variables in program memory
 #include <avr/sleep.h>		// sleep mode utilities
+#include <avr/wdt.h>			// watchdog, for WDT_JITTER
 #include <util/delay.h>		// some convenient delay functions
 #include <stdlib.h>			// some handy functions like utoa()
 
+#include "GeigerExtract.h"	// the extraction steps, shared with the host tools
+
 // Defines
-#define	F_CPU			8000000	// AVR clock speed in Hz
-#define	BAUD			9600	// Serial BAUD rate
+#ifndef F_CPU
+#define	F_CPU			8000000	// AVR clock speed in Hz, normally set by the Makefile
+#endif
 #define SER_BUFF_LEN	11		// Serial buffer length
-#define RAND_CHARS		64		// Define here the number of bytes to generate per request
+#define RAND_CHARS		64		// Define here the number of bytes to generate per request, and per line
+								// (the defaults, with COMMANDS they can be changed at run time)
+
+// Device specific definitions
+//
+// The code is written for the ATtiny2313 on the MightyOhm kit and uses its register names. It can
+// also be built for an ATmega328P (set DEVICE in the Makefile), for boards with more RAM and flash.
+// There the registers that only differ in name are mapped to their ATmega328P counterparts, and:
+// - the Geiger pulse goes to ICP1 (PB0, Arduino D8) instead of INT0. Timer1 latches TCNT1 into
+//   ICR1 at the edge, so the timestamp no longer depends on interrupt latency,
+// - the piezo is on OC0A, which is PD6 on this chip, so PULSE moves to PD7,
+// - the UART runs at 115200 baud and is interrupt driven, with a UART_TX_BUF_LEN byte buffer.
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__)
+#define UBRRH			UBRR0H
+#define UBRRL			UBRR0L
+#define UCSRA			UCSR0A
+#define UCSRB			UCSR0B
+#define UDR				UDR0
+#define UDRE			UDRE0
+#define U2X				U2X0
+#define RXEN			RXEN0
+#define RXCIE			RXCIE0
+#define TXEN			TXEN0
+#define UDRIE			UDRIE0
+#define GIMSK			EIMSK
+#define TIMSK			TIMSK1
+#define TIFR			TIFR1
+#define EXT_INT_CTRL	EICRA	// ISCxx bits, MCUCR on the ATtiny2313
+#define GEIGER_ICP				// Geiger pulses are timestamped by Timer1 input capture
+#define PIEZO_DDR		DDRD
+#define PIEZO_BIT		PD6
+#define PULSE_PORT		PORTD
+#define PULSE_DDR		DDRD
+#define PULSE_BIT		PD7
+#define TONE_PRESCALE	(_BV(CS01) | _BV(CS00))	// clk/64, 4us per count
+#define TONE_TOP		40		// toggle OC0A every 160us
+#ifndef BAUD
+#define	BAUD			115200	// Serial BAUD rate
+#endif
+#define UART_U2X				// double speed, for a closer match to BAUD at 16MHz
+#define UART_TX_BUF_LEN	256		// must be 256, the indexes wrap around on their own
+#define RAW_FIFO_LEN	32
+#define STAMP_FIFO_LEN	16
+#define WDT_VECT		WDT_vect
+#else
+#define EXT_INT_CTRL	MCUCR
+#define PIEZO_DDR		DDRB
+#define PIEZO_BIT		PB2
+#define PULSE_PORT		PORTD
+#define PULSE_DDR		DDRD
+#define PULSE_BIT		PD6
+#define TONE_PRESCALE	_BV(CS01)	// clk/8, 1us per count
+#define TONE_TOP		160		// toggle OC0A every 160us
+#ifndef BAUD
+#define	BAUD			9600	// Serial BAUD rate
+#endif
+#define WDT_VECT		WDT_OVERFLOW_vect
+#endif
+
+// Timer1 counts F_CPU/8, so a tick is 1us on the kit. It's reset every millisecond.
+#define TICKS_PER_MS	(F_CPU / 8000)
 
 // If defined, this will enable the piezo buzzer and make beeps.
 // Beeps occur only after a full byte is collected. (This equals 32 Geiger counts.)
@@ -224,41 +289,736 @@
 // and then we continue.
 #undef CONTINUOUS
 
+// If defined, the PULSE pin and a few spare pins are raised on entry to and lowered on exit from
+// the time critical code, so ISR durations and blocking windows can be measured with a logic
+// analyzer or with the simavr harness in sim/. This costs 2 cycles per edge.
+// Build with "make OPTIONS=-DINSTRUMENT" rather than editing this line.
+//#define INSTRUMENT
+
+// Instrumentation probes (port, pin). PD6 is the PULSE pin on the kit's header, the others are
+// unconnected pins of the ATtiny2313 that need a wire soldered to the chip to reach a probe.
+#define PROBE_INT0		PULSE_PORT, PULSE_BIT	// ISR(INT0_vect), rises right after the timestamp is taken
+#define PROBE_TIMER1	PORTD, PD5	// ISR(TIMER1_COMPA_vect)
+#define PROBE_REPORT	PORTD, PD4	// sendreport(), time spent blocked on the UART
+#define PROBE_BEEP		PORTB, PB1	// beep(), the window in which Geiger events are ignored
+#define PROBE_SPONGE	PORTB, PB3	// keccak_f200(), with CONDITION
+
+#ifdef INSTRUMENT
+#define PROBE_HIGH(probe)	PROBE_HIGH_(probe)
+#define PROBE_LOW(probe)	PROBE_LOW_(probe)
+#define PROBE_HIGH_(port, pin)	((port) |= _BV(pin))	// compiles to a single sbi
+#define PROBE_LOW_(port, pin)	((port) &= ~_BV(pin))	// compiles to a single cbi
+#else
+#define PROBE_HIGH(probe)
+#define PROBE_LOW(probe)
+#endif
+#define PROBE_PORT(probe)	PROBE_PORT_(probe)
+#define PROBE_PIN(probe)	PROBE_PIN_(probe)
+#define PROBE_PORT_(port, pin)	port
+#define PROBE_PIN_(port, pin)	pin
+
+// If defined, ISR(INT0_vect) is a naked assembly stub that reads TCNT1 two cycles after the
+// vector is taken, saving only r24, and returns right away unless we are counting. Only then
+// does it jump to the C code, which saves what it needs itself. The mode, rand_mask and
+// rand_byte live in the GPIOR0..2 I/O registers, which are cheaper to reach than SRAM.
+// Build with "make OPTIONS=-DFAST_INT0".
+//#define FAST_INT0
+#if defined(FAST_INT0) && defined(GEIGER_ICP)
+#error FAST_INT0 is for the ATtiny2313, input capture does better
+#endif
+
+// If defined, INT0 fires on both edges of the Geiger pulse and the pulse width (falling to rising
+// edge, in timer ticks) is used as a second source of bits next to the arrival intervals. Two
+// consecutive widths are compared the same way as two intervals; equal widths are thrown away,
+// since the width only jitters by a few microseconds and ties are common.
+// Build with "make OPTIONS=-DPULSE_WIDTH".
+//#define PULSE_WIDTH
+
+// If defined, the Geiger ISR only puts the timestamp (the low 16 bits of milliseconds and the
+// Timer1 count) in a small FIFO and returns. The intervals, comparisons and bytes are worked out
+// in the main loop, which wakes up after every interrupt anyway. Interrupts are then off for a
+// few dozen cycles per event instead of the hundreds the 32 bit arithmetic takes on a chip without
+// a multiplier, so Timer1 and a closely following Geiger event wait less. Events that don't fit
+// in the FIFO are lost, the bit they were part of starts over, and "#lost n" is sent at the start
+// of the next line.
+// Build with "make OPTIONS=-DDEFER_EXTRACT".
+//#define DEFER_EXTRACT
+#ifndef STAMP_FIFO_LEN
+#define STAMP_FIFO_LEN	4		// must be a power of 2
+#endif
+
+// If defined, no bits are computed. Instead the interval since the previous pulse (and its width,
+// with PULSE_WIDTH) in timer ticks is sent for every Geiger event as hex text, one event per line:
+// "interval" or "interval,width". This is meant for evaluating the source with minentropy.py.
+// Events that don't fit in the FIFO are lost, the interval spanning them is not reported, and
+// a "#lost n" line is sent.
+// Build with "make OPTIONS=-DRAW_EVENTS".
+//#define RAW_EVENTS
+#ifndef RAW_FIFO_LEN
+#define RAW_FIFO_LEN	4		// must be a power of 2
+#endif
+
+// If defined together with RAW_EVENTS, the intervals are sent as a binary stream of Golomb-Rice
+// codes instead of hex text. Intervals between decays are close to exponentially distributed, for
+// which Rice codes are close to optimal; the Rice parameter follows a running mean of the intervals.
+// This fits about 3 times as many events through the UART as hex text. Decode with ricedecode.py.
+//
+// The stream is made of frames of RICE_FRAME codes, padded to a whole byte. The first byte of a frame
+// is a 3 bit sequence number and a 5 bit exponent e; the running mean is set to 2^e at the start of
+// the frame, so a decoder can pick up the stream at any frame. An interval of 0 marks lost events.
+// Build with "make OPTIONS='-DRAW_EVENTS -DRAW_RICE'".
+//#define RAW_RICE
+#define RICE_FRAME		16		// codes per frame
+#define RICE_ESCAPE		24		// a quotient this large is sent as RICE_ESCAPE 1s and 32 raw bits
+
+// If USI_SPI or USI_TWI is defined, random bytes are not sent over the UART. Instead they are kept
+// in a buffer of USI_BUF_LEN bytes that another controller reads through the USI, either as an SPI
+// slave (mode 0, MSB first, with PB0 as the active low slave select) or as a TWI slave at address
+// USI_TWI_ADDRESS. Counting runs whenever there is room in the buffer; the button isn't used.
+// DI/SDA (PB5), DO (PB6) and USCK/SCL (PB7) are on the kit's ISP header.
+//
+// Every read transaction returns a status byte, the number of buffered bytes at the start of the
+// transaction, and then as many buffered bytes as the master clocks out. A byte is removed from the
+// buffer once it has been shifted out, never twice, and one that was loaded but not clocked out
+// is sent in the next transaction. Reading past the end returns 0s and sets
+// USI_UNDERRUN in the next status byte. Bytes written by a TWI master are ignored.
+//
+// The USI has no buffer, so an SPI master must leave some time between bytes for the overflow
+// interrupt to load the next one; 20us is plenty unless INT0 is very busy. A TWI master is held
+// off by clock stretching instead.
+// Build with "make OPTIONS=-DUSI_SPI" or "make OPTIONS=-DUSI_TWI".
+//#define USI_SPI
+//#define USI_TWI
+#define USI_BUF_LEN		16		// must be a power of 2
+#define USI_TWI_ADDRESS	0x47	// 7 bit TWI slave address
+#define USI_STATUS		0xa0	// high nibble of the status byte, so a master can tell we're there
+#define USI_COUNTING	0x01	// status: collecting bits
+#define USI_UNDERRUN	0x02	// status: a read went past the end of the buffer since the last status
+
+// Each output bit is the XOR (parity) of PARITY_FOLD raw comparison bits, 1 to 4. If the raw bits have
+// a bias e (P(1) = 1/2 + e), the folded bits have a bias of 2^(k-1) * e^k for k = PARITY_FOLD, at the
+// cost of k times as many Geiger events per byte. foldbias.py estimates both from a capture made with
+// PARITY_FOLD = 1. Build with eg. "make OPTIONS=-DPARITY_FOLD=2".
+#ifndef PARITY_FOLD
+#define PARITY_FOLD		1
+#endif
+#if PARITY_FOLD < 1 || PARITY_FOLD > 4
+#error PARITY_FOLD must be 1 to 4
+#endif
+
+// If defined, the raw bytes are conditioned before they are sent, with a Keccak-f[200] sponge in
+// duplex mode: raw bytes are XORed into the first CONDITION_RATE bytes of the 25 byte state, and
+// after every CONDITION_RATIO permutations those CONDITION_RATE bytes are sent. The other 21 bytes
+// (168 bits) never leave the chip. This adds a few hundred bytes of flash and 27 bytes of RAM, plus 12
+// of stack. The cost in cycles is measured with INSTRUMENT and the simulator (the "sponge" probe).
+// Build with "make OPTIONS=-DCONDITION".
+//#define CONDITION
+#define CONDITION_RATE	4		// bytes absorbed per permutation, and sent per output block
+#define CONDITION_RATIO	2		// raw bytes per conditioned byte
+
+// If defined, the host can set the batch size, line length and line terminator by sending
+// commands to the UART, and they are kept in EEPROM. See "Commands" in README.md.
+// There is no command channel with USI_SPI or USI_TWI (the UART isn't used) or with RAW_RICE
+// (the output is binary).
+#define COMMANDS
+#define CONFIG_MAGIC	0x47	// marks a valid configuration in EEPROM, a blank one reads 0xff
+
+// If defined, the firmware measures itself with Timer1: the latency from the Geiger edge to the
+// ISR (with input capture only, INT0 doesn't record when the edge came) and the duration of the
+// Geiger ISR, the same for ISR(TIMER1_COMPA_vect), and the time uart_putbyte() spends waiting
+// for the UART. The "P" command sends the count, maximum and total of each as a "#prof" line
+// of hex, see profdecode.py, and starts over. Costs 40 bytes of RAM and a few dozen cycles per
+// interrupt.
+// Build with "make OPTIONS=-DPROFILE".
+//#define PROFILE
+
+// If defined, the extraction follows the count rate. The ISR keeps a running mean of the intervals,
+// and at the end of each batch (every 256 bytes with no batch limit) the main program picks how the
+// next bytes are made: when the mean interval is below ADAPT_BELOW, from the low k bits of every
+// interval, otherwise from comparisons of pairs of intervals as usual. The low bits of an exponential
+// interval are close to uniform while 2^k is well below the mean, so k is the largest that keeps
+// 2^(k + ADAPT_MARGIN) <= mean, limited to ADAPT_MIN_BITS..ADAPT_MAX_BITS. Each change is announced
+// with a "#mode k" line (0 = comparisons) so the host can account for it. It goes out at once,
+// ending the line of hex if need be.
+// Build with "make OPTIONS=-DADAPT".
+//#define ADAPT
+#define ADAPT_BELOW		(10 * TICKS_PER_MS)	// low bits above 6000 CPM (mean interval < 10 ms)
+#define ADAPT_MARGIN	6		// the top low bit has a bias of at most about 2^-(ADAPT_MARGIN + 3)
+#define ADAPT_MIN_BITS	1
+#define ADAPT_MAX_BITS	4
+
+// If defined, the ISR watches the intervals for a sudden change of the count rate: a disconnected or
+// failing tube, a source moved closer or away, or pulses from interference or a noisy HV supply. It
+// learns the mean interval m over CHANGE_LEARN events, then runs two CUSUMs of the log likelihood
+// ratio of an exponential interval t, for the rate doubling (ln 2 - t/m per event) and halving
+// (t/2m - ln 2), both scaled by m so they take only adds and compares. When either sum reaches
+// CHANGE_THRESHOLD * m a "#rate up" or "#rate down" line is sent and the mean is learned again; each
+// new mean is reported as "#cpm n". In a simulation of this code at 900 CPM with a threshold of 14,
+// a doubling was caught after 70 events on average and a halving after 50, nine in ten of either
+// within about 100, and there were 3 false alarms in 5 million events. With ADAPT the new mean
+// also replaces the running mean, so the extraction (and the "#mode k" the host credits) follows at
+// once. Intervals only count while counting, and below about 4 CPM (mean interval over 2^24 ticks)
+// the mean is taken as 2^24. A tube that stops entirely makes no intervals; geigerd -c catches that.
+// Build with "make OPTIONS=-DCHANGE_DETECT".
+//#define CHANGE_DETECT
+#define CHANGE_LEARN_LOG2	8	// 256 events per mean
+#define CHANGE_LEARN		(1 << CHANGE_LEARN_LOG2)
+#define CHANGE_THRESHOLD	14
+#define CHANGE_MAX_MEAN		((1UL << 24) - 1)	// 256 of them still fit in 32 bits
+
+// If defined, the watchdog timer, which runs from its own RC oscillator, interrupts every 16 ms and
+// the low byte of TCNT1, which runs from the crystal, is sampled. The jitter between the two clocks
+// is a second, much weaker source: only the lowest bit of each sample is used, WDT_FOLD of them
+// are XORed into one bit, and that bit is XORed into a Geiger bit, at most WDT_SHARE of every
+// output byte. XORing can't lower the entropy of the Geiger bit as long as the watchdog bit is
+// independent of it, which takes care: the sample is taken when the ISR gets to run, later if
+// a Geiger ISR was running, so it depends on the timing of the Geiger events. A watchdog bit is
+// therefore only used in the byte after the one during which it was completed. The events of a
+// byte all come after counting restarts, and as Geiger events have no memory, their timing
+// doesn't depend on anything that happened before. Watchdog bits never make output bits of
+// their own, so without Geiger events they add nothing. Between batches, in push-button mode,
+// up to 8 bits are kept for the next one. The samples have health tests of their own: the
+// difference between consecutive samples may not repeat WDT_RCT_CUTOFF times in a row (the
+// clocks locked together), and each window of WDT_APT_WINDOW low bits must have between
+// WDT_APT_LOW and WDT_APT_HIGH ones, a false alarm about once a month. After a failure no
+// watchdog bits are used until a window passes, and "#wdt fail" is sent. The S command reports
+// how many of the output bits since the last report had a watchdog bit mixed in, eg. " W30/1024".
+// Build with "make OPTIONS=-DWDT_JITTER".
+//#define WDT_JITTER
+#define WDT_FOLD		16		// samples per bit, about 4 bits per second
+#define WDT_SHARE		2		// watchdog bits mixed into each output byte, at most
+#define WDT_RCT_CUTOFF	8
+#define WDT_APT_WINDOW	64
+#define WDT_APT_LOW		12		// fail at WDT_APT_LOW ones or fewer,
+#define WDT_APT_HIGH	52		// or at WDT_APT_HIGH or more
+
+// If defined, every Geiger event is counted, between batches too, and every RADLOG_PERIOD seconds
+// a radiation report in the format of the original MightyOhm firmware goes out between the lines
+// of random hex, eg. "#rad CPS, 1, CPM, 24, uSv/hr, 0.13": the events in the last second and in
+// the last minute (scaled up during the first minute), and the dose rate for an SBM-20 tube. The
+// ISR only increments a counter, the rest is done in the main loop. Like the other '#' lines, a
+// report waits for the end of the current line of hex. Costs 2 bytes of RAM per RADLOG_PERIOD in
+// a minute, plus 14.
+// Build with "make OPTIONS=-DRADLOG".
+//#define RADLOG
+#define RADLOG_PERIOD		10		// seconds, must divide 60
+#define RADLOG_CPM_PER_USV	175		// CPM per uSv/h, 0.0057 uSv/h per CPM as in the MightyOhm firmware
+
+#ifdef CONDITION
+#define OUT_CHUNK	CONDITION_RATE	// bytes that become ready at the same time
+#if RAND_CHARS % CONDITION_RATE
+#error RAND_CHARS must be a multiple of CONDITION_RATE
+#endif
+#else
+#define OUT_CHUNK	1
+#endif
+
+#if defined(USI_SPI) || defined(USI_TWI)
+#define USI_SLAVE
+#endif
+#if defined(COMMANDS) && (defined(USI_SLAVE) || defined(RAW_RICE))
+#undef COMMANDS
+#endif
+#if defined(PROFILE) && !defined(COMMANDS)
+#error PROFILE reports through the command channel, not with USI_SPI, USI_TWI or RAW_RICE
+#endif
+#if defined(ADAPT) && (defined(RAW_EVENTS) || defined(PULSE_WIDTH) || defined(USI_SLAVE))
+#error ADAPT works on the comparison output over the UART, not with RAW_EVENTS, PULSE_WIDTH or USI
+#endif
+#if defined(WDT_JITTER) && defined(RAW_EVENTS)
+#error WDT_JITTER mixes into the output bits, RAW_EVENTS has none
+#endif
+#if defined(RADLOG) && (defined(RAW_RICE) || defined(USI_SLAVE))
+#error RADLOG reports as text over the UART, not with RAW_RICE or USI
+#endif
+#if defined(RADLOG) && defined(FAST_INT0)
+#error RADLOG counts in the C part of the Geiger ISR, which FAST_INT0 skips between batches
+#endif
+#if defined(RADLOG) && 60 % RADLOG_PERIOD
+#error RADLOG_PERIOD must divide 60
+#endif
+#if defined(CHANGE_DETECT) && (defined(RAW_EVENTS) || defined(USI_SLAVE))
+#error CHANGE_DETECT reports over the UART, not with RAW_EVENTS (run it on the intervals on the host) or USI
+#endif
+#if defined(USI_SPI) && defined(USI_TWI)
+#error USI_SPI and USI_TWI cannot be used together
+#endif
+#if defined(USI_SLAVE) && !defined(USICR)
+#error This device has no USI
+#endif
+#if defined(USI_SLAVE) && defined(RAW_EVENTS)
+#error RAW_EVENTS is sent over the UART only
+#endif
+
+#if defined(DEFER_EXTRACT) && defined(RAW_EVENTS)
+#error RAW_EVENTS already leaves the output to the main program, DEFER_EXTRACT is for the bits
+#endif
+#if defined(RAW_RICE) && !defined(RAW_EVENTS)
+#error RAW_RICE needs RAW_EVENTS
+#endif
+#if defined(RAW_RICE) && defined(PULSE_WIDTH)
+#error RAW_RICE only codes intervals, use hex RAW_EVENTS to export pulse widths
+#endif
+
 // Function prototypes
+void uart_putbyte(uint8_t c);		// send a byte to the serial port, no CRLF translation
 void uart_putchar(char c);			// send a character to the serial port
 void uart_putstring(char *buffer);		// send a null-terminated string in SRAM to the serial port
 void uart_putstring_P(char *buffer);	// send a null-terminated string in PROGMEM to the serial port
 
-void sendreport(void);	// log data over the serial port
+void sendreport(uint8_t b);	// log data over the serial port
 
 // Global variables
 volatile uint32_t t1;
 volatile uint32_t t2;
 volatile uint32_t t3;
-volatile uint8_t rand_byte;
 #define MODE_OFF 0
-#define MODE_COUNTING 1
+#define MODE_COUNTING 1		// the INT0 fast path relies on this being the only mode with bit 0 set
 #define MODE_DONE 2
+#ifdef FAST_INT0
+#define mode		GPIOR0
+#define rand_mask	GPIOR1
+#define rand_byte	GPIOR2
+volatile uint16_t int0_stamp;	// TCNT1 as captured by the INT0 fast path
+#else
+volatile uint8_t rand_byte;
 volatile uint8_t mode;
-volatile uint32_t milliseconds;
 volatile uint8_t rand_mask;
+#endif
+volatile uint32_t milliseconds;
+#if PARITY_FOLD > 1
+uint8_t fold_acc;				// parity of the raw bits folded so far
+uint8_t fold_n;					// number of raw bits folded so far
+#endif
+#ifdef PULSE_WIDTH
+volatile uint32_t fall_time;	// time of the falling edge of the current pulse, 0 if unknown
+volatile uint16_t w1;			// first pulse width of a pair
+#endif
+#if defined(RAW_EVENTS) || defined(ADAPT) || defined(CHANGE_DETECT)
+volatile uint32_t last_event;	// time of the previous falling edge, 0 if unknown
+#endif
+#ifdef ADAPT
+volatile uint32_t adapt_mean;	// running mean of the intervals
+uint8_t extract_bits;			// low bits taken per interval, 0 = comparisons. Set between bytes.
+uint8_t adapt_count;			// bytes since the last choice, with no batch limit
+#endif
+#ifdef CHANGE_DETECT
+#define CHANGE_UP		0x01
+#define CHANGE_DOWN		0x02
+#define CHANGE_MEAN		0x04
+volatile uint8_t change_flags;	// news for the main program
+volatile uint32_t change_mean;	// learned mean interval m
+uint32_t change_ln2m;			// ln 2 * m
+uint32_t change_limit;			// CHANGE_THRESHOLD * m
+uint32_t change_up;				// the CUSUMs, change_up is the sum of the intervals while learning
+uint32_t change_down;
+uint16_t change_learn;			// intervals learned so far, CHANGE_LEARN when done
+#endif
+#ifdef RAW_EVENTS
+struct raw_event {
+	uint32_t interval;
+	uint16_t width;
+};
+volatile struct raw_event raw_fifo[RAW_FIFO_LEN];
+volatile uint8_t raw_head;		// written by the ISR
+volatile uint8_t raw_tail;		// written by the main program
+volatile uint8_t raw_lost;
+#ifdef PULSE_WIDTH
+volatile uint32_t raw_interval;	// interval waiting for the width of its pulse
+#endif
+#endif
+#ifdef DEFER_EXTRACT
+#define STAMP_RISING	0x01	// a rising edge, with PULSE_WIDTH
+#define STAMP_GAP		0x02	// events were lost right before this one
+struct stamp {
+	uint16_t ms;				// low bits of milliseconds
+	uint16_t ticks;				// Timer1 count within the millisecond
+	uint8_t flags;
+};
+volatile struct stamp stamp_fifo[STAMP_FIFO_LEN];
+volatile uint8_t stamp_head;	// written by the ISR
+volatile uint8_t stamp_tail;	// written by the main program
+volatile uint8_t stamp_gap;		// STAMP_GAP if the next stamp follows lost events
+volatile uint8_t stamp_lost;	// events lost since the last report
+#endif
+#ifdef RAW_RICE
+uint32_t rice_mean;				// running mean of the intervals, picks the Rice parameter
+uint8_t rice_acc;				// bits waiting to be sent, MSB first
+uint8_t rice_bits;				// number of bits in rice_acc
+uint8_t rice_count;				// codes in the current frame
+uint8_t rice_seq;				// frame sequence number
+#endif
+#ifdef USI_SLAVE
+volatile uint8_t usi_buf[USI_BUF_LEN];
+volatile uint8_t usi_head;		// written by the main program
+volatile uint8_t usi_tail;		// written by the USI ISRs
+uint8_t usi_index;				// position in the current read transaction
+uint8_t usi_avail;				// bytes buffered when the transaction started
+uint8_t usi_flags;				// USI_UNDERRUN
+uint8_t usi_loaded;				// what is in USIDR: USI_LOADED_DATA, USI_LOADED_EMPTY or 0
+#ifdef USI_SPI
+uint8_t usi_selected;			// the master pulled PB0 low, and hasn't raised it since
+#endif
+#define USI_LOADED_DATA		1	// the byte at usi_tail
+#define USI_LOADED_EMPTY	2	// a 0 past the end of the buffer
+#endif
+#ifdef USI_TWI
+#define TWI_CHECK_ADDRESS	0
+#define TWI_SEND_DATA		1
+#define TWI_REQUEST_REPLY	2
+#define TWI_CHECK_REPLY		3
+#define TWI_REQUEST_DATA	4
+#define TWI_GET_DATA		5
+uint8_t twi_state;
+#endif
+#ifdef CONDITION
+uint8_t sponge[25];				// Keccak-f[200] state
+uint8_t sponge_pos;				// next byte of the rate to absorb into
+uint8_t sponge_blocks;			// permutations since the last output
+#endif
+#ifdef WDT_JITTER
+#define WDT_FAILED		0x01	// news for the main program
+volatile uint8_t wdt_flags;
+volatile uint8_t wdt_bits;		// bits ready for the output, newest in bit 0
+volatile uint8_t wdt_nbits;
+volatile uint8_t wdt_ready;		// of which the oldest this many were completed before this byte
+uint8_t wdt_last;				// previous sample
+uint8_t wdt_delta;				// and the difference to the one before it
+uint8_t wdt_rct;				// times the difference came in a row
+uint8_t wdt_ones;				// ones in the current window
+uint8_t wdt_seen;				// samples in the current window
+uint8_t wdt_bad;				// a test failed, the bits aren't used until a window passes
+uint8_t wdt_acc;				// parity of the samples folded so far
+uint8_t wdt_fold_n;
+uint8_t wdt_share;				// watchdog bits mixed into the current byte
+volatile uint16_t mix_total;	// output bits since the last report
+volatile uint16_t mix_wdt;		// of which with a watchdog bit mixed in
+#endif
+#ifdef RADLOG
+#define RADLOG_BINS		(60 / RADLOG_PERIOD)
+volatile uint16_t rad_count;	// Geiger events since the last second
+uint32_t rad_second = 1000;		// milliseconds at the end of the current second
+uint16_t rad_cps;				// events in the last whole second
+uint16_t rad_sum;				// events in the current period
+uint8_t rad_seconds;			// seconds into the current period
+uint16_t rad_bin[RADLOG_BINS];	// events per period over the last minute
+uint8_t rad_next;				// the oldest period, overwritten next
+uint8_t rad_full;				// periods in rad_bin so far, up to RADLOG_BINS
+uint8_t rad_due;				// a period ended and hasn't been reported yet
+#endif
+#ifdef PROFILE
+#define PROF_INT0_LATENCY	0	// Geiger edge to ISR entry, GEIGER_ICP only
+#define PROF_INT0			1	// Geiger ISR, entry to exit
+#define PROF_TIMER1_LATENCY	2	// compare match to ISR entry
+#define PROF_TIMER1			3	// ISR(TIMER1_COMPA_vect), entry to exit
+#define PROF_UART			4	// uart_putbyte() waiting for room
+#define PROF_N				5
+#define PROF_VERSION		1
+struct prof_stat {				// in Timer1 ticks
+	uint16_t count;
+	uint16_t max;
+	uint32_t sum;
+};
+volatile struct prof_stat prof[PROF_N];
+#endif
+#ifdef UART_TX_BUF_LEN
+volatile uint8_t tx_buf[UART_TX_BUF_LEN];
+volatile uint8_t tx_head;		// written by uart_putbyte()
+volatile uint8_t tx_tail;		// written by ISR(USART_UDRE_vect)
+#endif
 char serbuf[SER_BUFF_LEN];	// serial buffer
 uint16_t byte_count;
+uint16_t line_count;
+uint8_t line_open;				// random data went out since the last line terminator
+uint8_t batch_done;				// config.batch bytes were sent
+#define TERM_NONE	0
+#define TERM_CRLF	1
+#define TERM_LF		2
+#define TERM_CR		3
+struct config {
+	uint8_t magic;				// CONFIG_MAGIC
+	uint16_t batch;				// bytes per request (or button press), 0 = no limit
+	uint16_t line;				// bytes per line, 0 = no line breaks
+	uint8_t term;				// line terminator, TERM_*
+};
+struct config config;
+#ifdef COMMANDS
+struct config ee_config EEMEM;
+volatile char cmd;				// command letter
+volatile uint16_t cmd_arg;		// and its decimal argument
+volatile uint8_t cmd_ready;		// set by ISR(USART_RX_vect) at the end of the line
+#endif
 
 // Interrupt service routines
 
-//	Pin change interrupt for pin INT0
-//	This interrupt is called on the falling edge of a GM pulse.
-ISR(INT0_vect)
+#ifdef PROFILE
+// Timer1 ticks from from to to, less than a millisecond apart. Timer1 counts to TICKS_PER_MS - 1.
+static inline uint16_t prof_ticks(uint16_t from, uint16_t to)
 {
-	uint16_t micros;
-	uint32_t event;
-	// First, capture the timer ASAP
-	micros = TCNT1;
-	// Now, exit if we're not in counting mode
-	if (mode != MODE_COUNTING)
+	return to >= from ? to - from : to + TICKS_PER_MS - from;
+}
+
+// Add a measurement. Interrupts must be off. When the count would overflow, count and total
+// are halved, so the mean follows the recent values.
+static inline void prof_add(uint8_t i, uint16_t ticks)
+{
+	volatile struct prof_stat *p = &prof[i];
+
+	if (ticks > p->max)
+		p->max = ticks;
+	p->sum += ticks;
+	if (++p->count == 0) {
+		p->count = 0x8000;
+		p->sum >>= 1;
+	}
+}
+#endif
+
+// Add a bit to rand_byte. After 8 bits, hand the byte over to the main program.
+static inline void add_bit(uint8_t bit)
+{
+#ifdef WDT_JITTER
+	if (++mix_total == 0x8000) {
+		mix_total >>= 1;		// keep the ratio, forget the oldest
+		mix_wdt >>= 1;
+	}
+#endif
+	if (bit)
+		rand_byte ^= rand_mask;
+	// Update the mask
+	if (rand_mask != 0x80) {
+		// We don't have 8 bits yet, rotate the mask
+		rand_mask <<= 1;
+	} else {
+		// We have 8 bits, we're ready to report this via serial
+		
+		// Flipping the comparison criteria with every other bit is done so that if there
+		// is any bias towards pulse timing increasing over time (say, due to half life of
+		// the source as it decays), then it won't result in a bias in the number of 1s or 0s.
+		// This doesn't add any antropy, just helps to correct the balance of 1s nd 0s. 
+		// In practice, this should be utterly inconsequential of sources with multi-year half
+		// lives, but it's onw line of code to correct this.
+		rand_byte ^= GX_FLIP;
+		
+		// Reset the mask and let the main program take this.
+		rand_mask = 0x01;
+		mode = MODE_DONE;
+	}
+}
+
+#ifdef WDT_JITTER
+// Take a watchdog bit completed before this byte, GX_NONE if there is none. Also called from the
+// main program, with DEFER_EXTRACT.
+static inline uint8_t wdt_take(void)
+{
+	uint8_t sreg = SREG;
+	uint8_t bit = GX_NONE;
+
+	cli();
+	if (wdt_ready) {
+		--wdt_ready;
+		--wdt_nbits;
+		bit = (wdt_bits >> wdt_nbits) & 1;	// oldest first
+	}
+	SREG = sreg;
+	return bit;
+}
+#endif
+
+// Add an extracted bit to rand_byte, after folding.
+static inline void push_bit(uint8_t bit)
+{
+#if PARITY_FOLD > 1
+	bit = gx_fold(&fold_acc, &fold_n, bit, PARITY_FOLD);
+	if (bit == GX_NONE)
 		return;
-	event = milliseconds * 1000 + micros;
+#endif
+#ifdef WDT_JITTER
+	// A watchdog bit is XORed into a Geiger bit, until the byte has its share. It was completed
+	// before the events of this byte, so it is independent of them and can only add entropy.
+	uint8_t w;
+	if (mode == MODE_COUNTING && wdt_share < WDT_SHARE && (w = wdt_take()) != GX_NONE) {
+		++wdt_share;
+		++mix_wdt;
+		bit ^= w;
+	}
+#endif
+	add_bit(bit);
+}
+
+#ifdef RAW_EVENTS
+// Queue an event for the main program, or count it as lost if the FIFO is full
+static inline void raw_push(uint32_t interval, uint16_t width)
+{
+	uint8_t head = raw_head;
+
+	if ((uint8_t)(head - raw_tail) == RAW_FIFO_LEN) {
+		++raw_lost;		// only this interval is lost, the next one starts at its event
+		return;
+	}
+	raw_fifo[head % RAW_FIFO_LEN].interval = interval;
+	raw_fifo[head % RAW_FIFO_LEN].width = width;
+	raw_head = head + 1;
+}
+#endif
+
+#ifdef PULSE_WIDTH
+// Whether the ISR was called for the rising edge at the end of a pulse. INT0 fires on both edges,
+// the pin tells us which one this was. With input capture ICES1 says which edge was captured, so
+// it has to be read before the ISR sets it up for the next one.
+static inline uint8_t rising_edge(void)
+{
+#ifdef GEIGER_ICP
+	return bit_is_set(TCCR1B, ICES1);
+#else
+	return bit_is_set(PIND, PD2);
+#endif
+}
+#define RISING_EDGE()	rising_edge()
+#else
+#define RISING_EDGE()	0
+#endif
+
+#ifdef DEFER_EXTRACT
+// Queue an event for the main program, or count it as lost if the FIFO is full
+static inline void stamp_push(uint16_t ms, uint16_t ticks, uint8_t rising)
+{
+	uint8_t head = stamp_head;
+
+	if ((uint8_t)(head - stamp_tail) == STAMP_FIFO_LEN) {
+		if (stamp_lost != 0xff)
+			++stamp_lost;
+		stamp_gap = STAMP_GAP;
+		return;
+	}
+	stamp_fifo[head % STAMP_FIFO_LEN].ms = ms;
+	stamp_fifo[head % STAMP_FIFO_LEN].ticks = ticks;
+	stamp_fifo[head % STAMP_FIFO_LEN].flags = stamp_gap | (rising ? STAMP_RISING : 0);
+	stamp_gap = 0;
+	stamp_head = head + 1;
+}
+#endif
+
+#ifdef PULSE_WIDTH
+// The rising edge at time event ends the current pulse
+static inline void collect_width(uint32_t event)
+{
+	uint16_t width;
+
+	if (fall_time == 0L)
+		return;		// we didn't see this pulse start
+	// Same edge case as with the intervals below
+	if (event < fall_time)
+		event += TICKS_PER_MS;
+	width = event - fall_time;
+	fall_time = 0L;
+#ifdef RAW_EVENTS
+	if (raw_interval != 0L) {
+		raw_push(raw_interval, width);
+		raw_interval = 0L;
+	}
+#else
+	if (w1 == 0) {
+		w1 = width;
+	} else {
+		// Ties are discarded, the next pulse starts a new pair
+		uint8_t bit = gx_compare_tie(w1, width);
+		if (bit != GX_NONE)
+			push_bit(bit);
+		w1 = 0;
+	}
+#endif
+}
+#endif
+
+#ifdef CHANGE_DETECT
+// One interval for the change detector, see CHANGE_DETECT
+static inline void change_event(uint32_t interval)
+{
+	uint32_t s;
+
+	if (interval > CHANGE_MAX_MEAN)
+		interval = CHANGE_MAX_MEAN;
+	if (change_learn < CHANGE_LEARN) {
+		change_up += interval;
+		if (++change_learn == CHANGE_LEARN) {
+			s = change_up >> CHANGE_LEARN_LOG2;
+			change_mean = s;
+			change_ln2m = (s >> 1) + (s >> 3) + (s >> 4) + (s >> 8);	// 0.6914 s
+			change_limit = s * CHANGE_THRESHOLD;
+			change_up = 0;
+			change_down = 0;
+			change_flags |= CHANGE_MEAN;
+		}
+		return;
+	}
+	// Rate doubled: + ln 2 m - t. Rate halved: + t/2 - ln 2 m. Both floored at 0.
+	s = change_up + change_ln2m;
+	change_up = s > interval ? s - interval : 0;
+	s = change_down + (interval >> 1);
+	change_down = s > change_ln2m ? s - change_ln2m : 0;
+	if (change_up >= change_limit || change_down >= change_limit) {
+		change_flags |= change_up >= change_limit ? CHANGE_UP : CHANGE_DOWN;
+		change_learn = 0;
+		change_up = 0;
+	}
+}
+#endif
+
+// Turn a Geiger event at time event (in timer ticks) into timing data, and the timing data into bits.
+// Called from ISR(INT0_vect) while we're counting, or with DEFER_EXTRACT from collect_stamps().
+static inline void collect_event(uint32_t event, uint8_t rising)
+{
+#ifdef PULSE_WIDTH
+	if (rising) {
+		collect_width(event);
+		return;
+	}
+	fall_time = event;
+#endif
+#ifdef RAW_EVENTS
+	if (last_event != 0L) {
+		if (event < last_event)
+			event += TICKS_PER_MS;
+#ifdef PULSE_WIDTH
+		raw_interval = event - last_event;
+#else
+		raw_push(event - last_event, 0);
+#endif
+	}
+	last_event = event;
+#else
+#if defined(ADAPT) || defined(CHANGE_DETECT)
+	if (last_event != 0L) {
+		uint32_t interval;
+#ifdef ADAPT
+		uint8_t k;
+#endif
+
+		if (event < last_event)
+			event += TICKS_PER_MS;
+		interval = event - last_event;
+#ifdef CHANGE_DETECT
+		change_event(interval);
+#endif
+#ifdef ADAPT
+		if (interval > adapt_mean)
+			adapt_mean += (interval - adapt_mean) >> 4;
+		else
+			adapt_mean -= (adapt_mean - interval) >> 4;
+		if (extract_bits) {
+			// Stop at the end of the byte, the rest are dropped like events between bytes
+			for (k = 0; k < extract_bits && mode == MODE_COUNTING; k++)
+				push_bit(gx_low_bit(interval, k));
+		}
+#endif
+	}
+	last_event = event;
+#ifdef ADAPT
+	if (extract_bits)
+		return;
+#endif
+#endif
 	if (t1 == 0L) {
 		t1 = event;
 	} else if (t2 == 0L) {
@@ -267,7 +1027,7 @@ ISR(INT0_vect)
 		// interrupt may not have executed yet! And T2 < T1
 		// which should never happen.
 		if (t2 < t1) {
-			t2 += 1000L;
+			t2 += TICKS_PER_MS;
 		}
 	} else if (t3 == 0L) {
 		t3 = event;
@@ -275,37 +1035,214 @@ ISR(INT0_vect)
 		// We've got all the data we need!
 		// Check for the same edge case
 		if (event < t3) {
-			event += 1000L;
+			event += TICKS_PER_MS;
 		}
 		// Make the determination of the bit
-		if ((event - t3) > (t2 - t1))
-			rand_byte ^= rand_mask;
+		push_bit(gx_compare(t2 - t1, event - t3));
 		// Reset the times
 		t1 = 0L;
 		t2 = 0L;
 		t3 = 0L;
-		// Update the mask
-		if (rand_mask != 0x80) {
-			// We don't have 8 bits yet, rotate the mask
-			rand_mask <<= 1;
-		} else {
-			// We have 8 bits, we're ready to report this via serial
-			
-			// Flipping the comparison criteria with every other bit is done so that if there
-			// is any bias towards pulse timing increasing over time (say, due to half life of
-			// the source as it decays), then it won't result in a bias in the number of 1s or 0s.
-			// This doesn't add any antropy, just helps to correct the balance of 1s nd 0s. 
-			// In practice, this should be utterly inconsequential of sources with multi-year half
-			// lives, but it's onw line of code to correct this.
-			rand_byte ^= 0xaa;
-			
-			// Reset the mask and let the main program take this.
-			rand_mask = 0x01;
-			mode = MODE_DONE;
-		}
 	}
+#endif
+}
+
+// Forget the events of a bit that isn't complete, they can't be used with the ones that follow
+static void collect_restart(void)
+{
+	t1 = 0L;
+	t2 = 0L;
+	t3 = 0L;
+#ifdef PULSE_WIDTH
+	fall_time = 0L;
+	w1 = 0;
+#endif
+#if defined(ADAPT) || defined(CHANGE_DETECT)
+	last_event = 0L;	// an interval across the gap would be too long
+#endif
+}
+
+#ifdef USI_SLAVE
+// Start a read transaction
+static inline void usi_begin(void)
+{
+	usi_index = 0;
+	usi_avail = usi_head - usi_tail;
+	usi_loaded = 0;			// not clocked out, it stays in the buffer
+}
+
+// The byte loaded last has been shifted out: take it off the buffer
+static inline void usi_shifted(void)
+{
+	if (usi_loaded == USI_LOADED_DATA)
+		++usi_tail;
+	else if (usi_loaded == USI_LOADED_EMPTY)
+		usi_flags |= USI_UNDERRUN;
+	usi_loaded = 0;
+}
+
+// Next byte of a read transaction: status, count, then the buffered bytes. A buffered byte is only
+// looked at here, usi_shifted() removes it once the master has clocked it out.
+static uint8_t usi_next(void)
+{
+	uint8_t b;
+
+	if (usi_index == 0) {
+		usi_index = 1;
+		b = USI_STATUS | usi_flags;
+		if (mode == MODE_COUNTING)
+			b |= USI_COUNTING;
+		usi_flags = 0;
+	} else if (usi_index == 1) {
+		usi_index = 2;
+		b = usi_avail;
+	} else if (usi_tail == usi_head) {
+		usi_loaded = USI_LOADED_EMPTY;
+		b = 0;
+	} else {
+		usi_loaded = USI_LOADED_DATA;
+		b = usi_buf[usi_tail % USI_BUF_LEN];
+	}
+	return b;
+}
+#endif
+
+#if defined(GEIGER_ICP)
+
+//	Timer1 input capture, on the falling edge of a GM pulse (and on the rising edge with PULSE_WIDTH)
+//	Timer1 copied TCNT1 into ICR1 at the edge, so the timestamp doesn't depend on how long it took to
+//	get here. That does mean working out which millisecond it belongs to: Timer1 may have been reset
+//	between the edge and now, and ISR(TIMER1_COMPA_vect) may or may not have run since.
+ISR(TIMER1_CAPT_vect)
+{
+	uint16_t stamp = ICR1;
+	uint16_t now = TCNT1;
+	uint32_t ms = milliseconds;
+	const uint8_t rising = RISING_EDGE();
+
+	PROBE_HIGH(PROBE_INT0);
+#ifdef PULSE_WIDTH
+	// Catch the edge away from the level the pin is at now. Only toggling ICES1 would swap rising
+	// and falling for good after a pulse too short for the ISR to see both of its edges.
+	if (bit_is_set(PINB, PB0))
+		TCCR1B &= ~_BV(ICES1);
+	else
+		TCCR1B |= _BV(ICES1);
+	TIFR = _BV(ICF1);		// changing the edge may set ICF1, that capture isn't an edge
+#endif
+	if (bit_is_set(TIFR, OCF1A)) {
+		// Timer1 reached OCR1A but milliseconds hasn't been incremented yet. A small stamp means
+		// the edge came after the reset (the flag is set a tick before TCNT1 goes back to 0).
+		if (stamp < TICKS_PER_MS / 2)
+			++ms;
+	} else if (stamp > now) {
+		--ms;			// Timer1 was reset after the edge and milliseconds was incremented
+	}
+#ifdef RADLOG
+	if (!rising)
+		++rad_count;
+#endif
+	if (mode == MODE_COUNTING) {
+#ifdef DEFER_EXTRACT
+		stamp_push(ms, stamp, rising);
+#else
+		collect_event(ms * TICKS_PER_MS + stamp, rising);
+#endif
+	}
+#ifdef PROFILE
+	prof_add(PROF_INT0_LATENCY, prof_ticks(stamp, now));
+	prof_add(PROF_INT0, prof_ticks(now, TCNT1));
+#endif
+	PROBE_LOW(PROBE_INT0);
 }
 
+#elif !defined(FAST_INT0)
+
+//	Pin change interrupt for pin INT0
+//	This interrupt is called on the falling edge of a GM pulse (and on the rising edge with PULSE_WIDTH).
+ISR(INT0_vect)
+{
+	uint16_t micros;
+	// First, capture the timer ASAP
+	micros = TCNT1;
+	PROBE_HIGH(PROBE_INT0);
+#ifdef RADLOG
+	if (!RISING_EDGE())
+		++rad_count;
+#endif
+	// Now, ignore the event unless we're in counting mode
+	if (mode == MODE_COUNTING) {
+#ifdef DEFER_EXTRACT
+		stamp_push(milliseconds, micros, RISING_EDGE());
+#else
+		collect_event(milliseconds * TICKS_PER_MS + micros, RISING_EDGE());
+#endif
+	}
+#ifdef PROFILE
+	prof_add(PROF_INT0, prof_ticks(micros, TCNT1));
+#endif
+	PROBE_LOW(PROBE_INT0);
+}
+
+#else
+
+#ifdef INSTRUMENT
+#define INT0_PROBE_HIGH_ASM	"sbi %[probe_port], %[probe_pin]\n\t"
+#define INT0_PROBE_LOW_ASM	"cbi %[probe_port], %[probe_pin]\n\t"
+#else
+#define INT0_PROBE_HIGH_ASM
+#define INT0_PROBE_LOW_ASM
+#endif
+#ifdef __AVR_HAVE_JMP_CALL__
+#define INT0_JMP_ASM	"jmp "
+#else
+#define INT0_JMP_ASM	"rjmp "
+#endif
+#define INT0_BODY_vect	__vector_int0_body	// not a real vector, entered from the stub below
+
+//	Pin change interrupt for pin INT0, fast path
+//	None of these instructions touch SREG, so it doesn't need to be saved.
+ISR(INT0_vect, ISR_NAKED)
+{
+	asm volatile(
+		"push r24\n\t"
+		"in r24, %[tcnt1l]\n\t"		// reading the low byte latches the high byte
+		"sts int0_stamp, r24\n\t"
+		"in r24, %[tcnt1h]\n\t"
+		"sts int0_stamp+1, r24\n\t"
+		INT0_PROBE_HIGH_ASM
+		"sbic %[gpior0], 0\n\t"			// MODE_COUNTING?
+		"rjmp 1f\n\t"
+		INT0_PROBE_LOW_ASM
+		"pop r24\n\t"
+		"reti\n"
+		"1:\tpop r24\n\t"
+		INT0_JMP_ASM "__vector_int0_body\n\t"
+		:
+		: [tcnt1l] "I" (_SFR_IO_ADDR(TCNT1L)),
+		  [tcnt1h] "I" (_SFR_IO_ADDR(TCNT1H)),
+		  [gpior0] "I" (_SFR_IO_ADDR(GPIOR0)),
+		  [probe_port] "I" (_SFR_IO_ADDR(PROBE_PORT(PROBE_INT0))),
+		  [probe_pin] "I" (PROBE_PIN(PROBE_INT0))
+	);
+}
+
+// The part of the INT0 handler written in C, it ends with a reti like any other ISR.
+ISR(INT0_BODY_vect)
+{
+#ifdef DEFER_EXTRACT
+	stamp_push(milliseconds, int0_stamp, RISING_EDGE());
+#else
+	collect_event(milliseconds * TICKS_PER_MS + int0_stamp, RISING_EDGE());
+#endif
+#ifdef PROFILE
+	prof_add(PROF_INT0, prof_ticks(int0_stamp, TCNT1));	// while counting, the fast path is a few cycles
+#endif
+	PROBE_LOW(PROBE_INT0);
+}
+
+#endif
+
 //	Pin change interrupt for pin INT1 (pushbutton)
 //	If the user pushes the button, this interrupt is executed.
 //	We need to be careful about switch bounce, which will make the interrupt
@@ -330,19 +1267,305 @@ ISR(INT1_vect)
  */
 ISR(TIMER1_COMPA_vect)
 {
+#ifdef PROFILE
+	uint16_t entry = TCNT1;		// Timer1 went back to 0 at the compare match, so this is the latency
+#endif
+	PROBE_HIGH(PROBE_TIMER1);
 	++milliseconds;
+#ifdef PROFILE
+	prof_add(PROF_TIMER1_LATENCY, entry);
+	prof_add(PROF_TIMER1, prof_ticks(entry, TCNT1));
+#endif
+	PROBE_LOW(PROBE_TIMER1);
+}
+
+#ifdef WDT_JITTER
+//	Watchdog timer, every 16 ms from its own RC oscillator
+//	Timer1 runs from the crystal, where it is when the watchdog fires jitters with both clocks.
+ISR(WDT_VECT)
+{
+	uint8_t sample = TCNT1L;
+	uint8_t delta = sample - wdt_last;
+	uint8_t fail = 0;
+
+	wdt_last = sample;
+	// Repetition count test on the differences: the same one over and over means the clocks are
+	// locked together (or the sample is stuck)
+	if (delta == wdt_delta) {
+		if (++wdt_rct >= WDT_RCT_CUTOFF)
+			fail = 1;
+	} else {
+		wdt_delta = delta;
+		wdt_rct = 1;
+	}
+	// Proportion of ones among the low bits, per window
+	wdt_ones += sample & 1;
+	if (++wdt_seen == WDT_APT_WINDOW) {
+		if (wdt_ones <= WDT_APT_LOW || wdt_ones >= WDT_APT_HIGH)
+			fail = 1;
+		else
+			wdt_bad = 0;		// a whole window passed
+		wdt_ones = 0;
+		wdt_seen = 0;
+	}
+	if (fail) {
+		if (!wdt_bad)
+			wdt_flags |= WDT_FAILED;
+		wdt_bad = 1;
+		wdt_rct = 0;
+		wdt_ones = 0;
+		wdt_seen = 0;
+		wdt_nbits = 0;			// drop what was kept, it may be as bad
+		wdt_ready = 0;
+		wdt_fold_n = 0;
+		wdt_acc = 0;
+		return;
+	}
+
+	wdt_acc ^= sample & 1;
+	if (++wdt_fold_n == WDT_FOLD) {
+		if (!wdt_bad && wdt_nbits < 8) {
+			wdt_bits = (wdt_bits << 1) | wdt_acc;
+			++wdt_nbits;
+		}
+		wdt_acc = 0;
+		wdt_fold_n = 0;
+	}
+}
+#endif
+
+#ifdef COMMANDS
+//	UART receive: collect a command, a letter followed by an optional number and the end of the line.
+//	The main program carries it out and clears cmd_ready, anything received until then is dropped.
+ISR(USART_RX_vect)
+{
+	char c = UDR;
+
+	if (cmd_ready)
+		return;
+	if (c >= '0' && c <= '9') {
+		c -= '0';
+		if (cmd_arg > 6553 || (cmd_arg == 6553 && c > 5))
+			cmd = '?';			// over 65535, answered with "#?" rather than wrapped around
+		cmd_arg = cmd_arg * 10 + c;
+	} else if (c == '\r' || c == '\n') {
+		if (cmd)
+			cmd_ready = 1;
+	} else if (c != ' ') {
+		cmd = c & ~0x20;		// upper case
+		cmd_arg = 0;
+	}
+}
+#endif
+
+#ifdef UART_TX_BUF_LEN
+//	UART data register empty: send the next byte from the buffer
+ISR(USART_UDRE_vect)
+{
+	if (tx_tail == tx_head) {
+		UCSRB &= ~_BV(UDRIE);	// nothing left to send
+		return;
+	}
+	UDR = tx_buf[tx_tail];
+	++tx_tail;
+}
+#endif
+
+#ifdef USI_SPI
+//	Pin change interrupt for port B, only PB0 (slave select) is enabled
+//	The master selecting us starts a new transaction.
+ISR(PCINT_vect)
+{
+	// The master may raise PB0 right after the last clock, before the overflow interrupt (which
+	// has the lower priority) got to run. That byte is out all the same.
+	if (usi_selected && bit_is_set(USISR, USIOIF))
+		usi_shifted();
+	if (bit_is_clear(PINB, PB0)) {
+		usi_selected = 1;
+		usi_begin();
+		USIDR = usi_next();
+		DDRB |= _BV(PB6);		// drive DO while we're selected
+	} else {
+		usi_selected = 0;
+		DDRB &= ~_BV(PB6);
+	}
+	USISR = _BV(USIOIF);		// clear the overflow flag and the counter
+}
+
+//	USI counter overflow: a byte has been shifted out, load the next one
+//	The clock may also belong to a transfer with another slave on the bus. Selection is taken from
+//	usi_selected rather than the pin, which the master may already have raised again.
+ISR(USI_OVERFLOW_vect)
+{
+	if (usi_selected) {
+		usi_shifted();
+		USIDR = usi_next();
+	}
+	USISR = _BV(USIOIF);
+}
+#endif
+
+#ifdef USI_TWI
+// USI setup for the states of the TWI slave, after Atmel application note AVR312
+static inline void twi_wait_for_start(void)
+{
+	USICR = _BV(USISIE) | _BV(USIWM1) | _BV(USICS1);
+	USISR = _BV(USIOIF) | _BV(USIPF) | _BV(USIDC);
 }
 
+// Shift 1 bit (the ACK) or 8 bits of data in or out, with SDA driven by us or the master
+static inline void twi_shift(uint8_t drive_sda, uint8_t count)
+{
+	if (drive_sda)
+		DDRB |= _BV(PB5);
+	else
+		DDRB &= ~_BV(PB5);
+	USISR = _BV(USIOIF) | _BV(USIPF) | _BV(USIDC) | (count << USICNT0);
+}
+#define TWI_BIT		0x0e	// counter start value for 1 bit (2 clock edges)
+#define TWI_BYTE	0x00	// counter start value for 8 bits
+
+//	USI start condition
+ISR(USI_START_vect)
+{
+	twi_state = TWI_CHECK_ADDRESS;
+	DDRB &= ~_BV(PB5);
+	// Wait for the master to pull SCL low to finish the start condition, or for a stop condition
+	while (bit_is_set(PINB, PB7) && bit_is_clear(PINB, PB5))
+		;
+	if (bit_is_clear(PINB, PB5)) {
+		// Hold SCL low on counter overflow so we have time to answer
+		USICR = _BV(USISIE) | _BV(USIOIE) | _BV(USIWM1) | _BV(USIWM0) | _BV(USICS1);
+	} else {
+		USICR = _BV(USISIE) | _BV(USIWM1) | _BV(USICS1);
+	}
+	USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC);
+}
+
+//	USI counter overflow: a byte or an ACK bit went over the bus
+ISR(USI_OVERFLOW_vect)
+{
+	switch (twi_state) {
+	case TWI_CHECK_ADDRESS:
+		if ((USIDR >> 1) != USI_TWI_ADDRESS) {
+			twi_wait_for_start();
+			return;
+		}
+		if (USIDR & 0x01) {
+			usi_begin();
+			twi_state = TWI_SEND_DATA;
+		} else {
+			twi_state = TWI_REQUEST_DATA;
+		}
+		USIDR = 0;					// ACK the address
+		twi_shift(1, TWI_BIT);
+		break;
+	case TWI_CHECK_REPLY:
+		if (USIDR) {				// NACK, the master is done reading
+			twi_wait_for_start();
+			return;
+		}
+		// fall through
+	case TWI_SEND_DATA:
+		USIDR = usi_next();
+		twi_state = TWI_REQUEST_REPLY;
+		twi_shift(1, TWI_BYTE);
+		break;
+	case TWI_REQUEST_REPLY:
+		usi_shifted();				// the byte is out, whether the master ACKs it or not
+		USIDR = 0;
+		twi_state = TWI_CHECK_REPLY;
+		twi_shift(0, TWI_BIT);
+		break;
+	case TWI_REQUEST_DATA:
+		twi_state = TWI_GET_DATA;
+		twi_shift(0, TWI_BYTE);
+		break;
+	case TWI_GET_DATA:
+		USIDR = 0;					// ACK and ignore the byte
+		twi_state = TWI_REQUEST_DATA;
+		twi_shift(1, TWI_BIT);
+		break;
+	}
+}
+#endif
+
 // Functions
 
+#ifdef PROFILE
+// Timer1 ticks since reset, for waits that can be longer than a millisecond
+static uint32_t prof_clock(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t ms;
+	uint16_t ticks;
+
+	cli();
+	ms = milliseconds;
+	ticks = TCNT1;
+	if (bit_is_set(TIFR, OCF1A) && ticks < TICKS_PER_MS / 2)
+		++ms;		// ISR(TIMER1_COMPA_vect) is still to come
+	SREG = sreg;
+	return ms * TICKS_PER_MS + ticks;
+}
+
+// uart_putbyte() waited since start
+static void prof_blocked(uint32_t start)
+{
+	uint32_t ticks = prof_clock() - start;
+	uint8_t sreg = SREG;
+
+	cli();
+	prof_add(PROF_UART, ticks > 0xffff ? 0xffff : ticks);
+	SREG = sreg;
+}
+#endif
+
 // Send a character to the UART
 void uart_putchar(char c)
 {
 	if (c == '\n') uart_putchar('\r');	// Windows-style CRLF
   
+	uart_putbyte(c);
+}
+
+#ifdef UART_TX_BUF_LEN
+// Send a byte of binary data to the UART, through the transmit buffer
+void uart_putbyte(uint8_t c)
+{
+	uint8_t head = tx_head;
+#ifdef PROFILE
+	uint8_t blocked = (uint8_t)(head + 1) == tx_tail;
+	uint32_t start = blocked ? prof_clock() : 0;
+#endif
+
+	while ((uint8_t)(head + 1) == tx_tail)
+		;								// wait until there is room in the buffer
+#ifdef PROFILE
+	if (blocked)
+		prof_blocked(start);
+#endif
+	tx_buf[head] = c;
+	tx_head = head + 1;
+	UCSRB |= _BV(UDRIE);				// ISR(USART_UDRE_vect) takes it from here
+}
+#else
+// Send a byte of binary data to the UART
+void uart_putbyte(uint8_t c)
+{
+#ifdef PROFILE
+	uint8_t blocked = bit_is_clear(UCSRA, UDRE);
+	uint32_t start = blocked ? prof_clock() : 0;
+#endif
+
 	loop_until_bit_is_set(UCSRA, UDRE);	// wait until UART is ready to accept a new character
+#ifdef PROFILE
+	if (blocked)
+		prof_blocked(start);
+#endif
 	UDR = c;							// send 1 character
 }
+#endif
 
 // Send a string in SRAM to the UART
 void uart_putstring(char *buffer)	
@@ -363,9 +1586,10 @@ void uart_putstring_P(char *buffer)
 }
 
 // log data over the serial port
-void sendreport(void)
+void sendreport(uint8_t b)
 {
-	ultoa(rand_byte, serbuf, 16);		// radix 16	
+	PROBE_HIGH(PROBE_REPORT);
+	ultoa(b, serbuf, 16);		// radix 16	
 	// Add a leading 0 if this is a single hex digit
 	if (serbuf[1] == 0) {
 		serbuf[2] = 0;
@@ -373,8 +1597,588 @@ void sendreport(void)
 		serbuf[0] = '0';
 	}
 	uart_putstring(serbuf);
+	PROBE_LOW(PROBE_REPORT);
+}
+
+// End a line of random data
+void putterm(void)
+{
+	if (config.term == TERM_CRLF || config.term == TERM_CR)
+		uart_putbyte('\r');
+	if (config.term == TERM_CRLF || config.term == TERM_LF)
+		uart_putbyte('\n');
+	if (config.term != TERM_NONE)
+		line_open = 0;
+}
+
+// Put what follows on a line of its own. Called before every status line: if random data went out
+// since the last terminator, end that line, with a '\n' like the status lines when there is no
+// terminator.
+void endline(void)
+{
+	if (line_open) {
+		if (config.term == TERM_NONE)
+			uart_putbyte('\n');
+		else
+			putterm();
+		line_open = 0;
+		line_count = 0;
+	}
+}
+
+// Whether a report may go out now, between two bytes. With line breaks it waits for the end of a
+// line, without them the hex sent so far is ended here.
+static inline uint8_t report_ok(void)
+{
+	if (config.line && line_count)
+		return 0;
+	endline();
+	return 1;
+}
+
+// Hand a random byte to the host
+void putrandom(uint8_t b)
+{
+#ifdef USI_SLAVE
+	usi_buf[usi_head % USI_BUF_LEN] = b;
+	++usi_head;		// the USI ISRs may read the byte from here on
+#else
+	sendreport(b);
+	line_open = 1;
+	// >= rather than ==, the host may have lowered the limits since the count started
+	if (config.line && ++line_count >= config.line) {
+		putterm();
+		line_count = 0;
+	}
+	if (config.batch && ++byte_count >= config.batch) {
+		if (line_open) {
+			putterm();	// a batch always ends a line
+			line_count = 0;
+		}
+		byte_count = 0;
+		batch_done = 1;
+	}
+#endif
 }
 
+#ifdef COMMANDS
+// Report the settings
+void sendconfig(void)
+{
+	uart_putstring_P((char *)PSTR("#cfg B"));
+	utoa(config.batch, serbuf, 10);
+	uart_putstring(serbuf);
+	uart_putstring_P((char *)PSTR(" L"));
+	utoa(config.line, serbuf, 10);
+	uart_putstring(serbuf);
+	uart_putstring_P((char *)PSTR(" T"));
+	utoa(config.term, serbuf, 10);
+	uart_putstring(serbuf);
+#ifdef ADAPT
+	uart_putstring_P((char *)PSTR(" M"));
+	utoa(extract_bits, serbuf, 10);
+	uart_putstring(serbuf);
+#endif
+#ifdef WDT_JITTER
+	{
+		uint16_t total, wdt;
+
+		cli();
+		total = mix_total;
+		wdt = mix_wdt;
+		mix_total = 0;
+		mix_wdt = 0;
+		sei();
+		uart_putstring_P((char *)PSTR(" W"));
+		utoa(wdt, serbuf, 10);
+		uart_putstring(serbuf);
+		uart_putchar('/');
+		utoa(total, serbuf, 10);
+		uart_putstring(serbuf);
+	}
+#endif
+	uart_putchar('\n');
+}
+
+#ifdef PROFILE
+// The options that change the timing, for the profile record
+static const uint16_t prof_options =
+#ifdef GEIGER_ICP
+	(1 << 0) |		// GEIGER_ICP
+#endif
+#ifdef FAST_INT0
+	(1 << 1) |		// FAST_INT0
+#endif
+#ifdef DEFER_EXTRACT
+	(1 << 2) |		// DEFER_EXTRACT
+#endif
+#ifdef PULSE_WIDTH
+	(1 << 3) |		// PULSE_WIDTH
+#endif
+#ifdef UART_TX_BUF_LEN
+	(1 << 4) |		// UART_TX_BUF_LEN
+#endif
+#ifdef CONDITION
+	(1 << 5) |		// CONDITION
+#endif
+#ifdef BEEP
+	(1 << 6) |		// BEEP
+#endif
+#ifdef INSTRUMENT
+	(1 << 7) |		// INSTRUMENT
+#endif
+#ifdef ADAPT
+	(1 << 8) |		// ADAPT
+#endif
+#ifdef CHANGE_DETECT
+	(1 << 9) |		// CHANGE_DETECT
+#endif
+#ifdef RAW_EVENTS
+	(1 << 10) |		// RAW_EVENTS
+#endif
+#ifdef CONTINUOUS
+	(1 << 11) |		// CONTINUOUS
+#endif
+#ifdef WDT_JITTER
+	(1 << 12) |		// WDT_JITTER
+#endif
+#ifdef RADLOG
+	(1 << 13) |		// RADLOG
+#endif
+	0;
+
+// Send the profile as "#prof " and the hex of a little endian record: version, PARITY_FOLD,
+// options, TICKS_PER_MS, and count, max and total of each measurement. Then start over.
+void sendprofile(void)
+{
+	struct prof_stat p;
+	uint8_t head[6] = {
+		PROF_VERSION, PARITY_FOLD, prof_options & 0xff, prof_options >> 8,
+		TICKS_PER_MS & 0xff, TICKS_PER_MS >> 8
+	};
+	uint8_t i, j;
+
+	uart_putstring_P((char *)PSTR("#prof "));
+	for (i = 0; i < sizeof(head); i++)
+		sendreport(head[i]);
+	// One at a time, a copy of all of them would take 40 bytes of stack
+	for (i = 0; i < PROF_N; i++) {
+		cli();
+		p = prof[i];
+		prof[i].count = 0;
+		prof[i].max = 0;
+		prof[i].sum = 0;
+		sei();
+		for (j = 0; j < sizeof(p); j++)
+			sendreport(((uint8_t *)&p)[j]);		// AVR is little endian
+	}
+	uart_putchar('\n');
+}
+#endif
+
+// Carry out a command from the host. The settings are written to EEPROM when they change.
+void command(void)
+{
+	uint16_t arg = cmd_arg;
+
+	endline();		// the answer goes on a line of its own
+	switch (cmd) {
+	case 'B':	// bytes per batch
+		if (arg % OUT_CHUNK)
+			goto bad;
+		config.batch = arg;
+		break;
+	case 'L':	// bytes per line
+		config.line = arg;
+		break;
+	case 'T':	// line terminator
+		if (arg > TERM_CR)
+			goto bad;
+		config.term = arg;
+		break;
+	case 'G':	// start a batch, like pressing the button
+		if (mode == MODE_OFF)
+			mode = MODE_COUNTING;
+		goto done;
+	case 'S':	// status
+		sendconfig();
+		goto done;
+#ifdef PROFILE
+	case 'P':	// profile
+		sendprofile();
+		goto done;
+#endif
+	default:
+	bad:
+		uart_putstring_P((char *)PSTR("#?\n"));
+		goto done;
+	}
+	eeprom_update_block(&config, &ee_config, sizeof(config));
+	sendconfig();
+done:
+	cmd = 0;
+	cmd_ready = 0;
+}
+#endif
+
+#ifdef CONDITION
+// Keccak-f[200] round constants, and the lane order and rotations (mod 8) of the rho and pi steps
+static const uint8_t keccak_rc[18] PROGMEM = {
+	0x01, 0x82, 0x8a, 0x00, 0x8b, 0x01, 0x81, 0x09, 0x8a,
+	0x88, 0x09, 0x0a, 0x8b, 0x8b, 0x89, 0x03, 0x02, 0x80
+};
+static const uint8_t keccak_pi[24] PROGMEM = {
+	10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+static const uint8_t keccak_rot[24] PROGMEM = {
+	1, 3, 6, 2, 7, 5, 4, 4, 5, 7, 2, 6, 3, 1, 0, 0, 1, 3, 6, 2, 7, 5, 4, 4
+};
+
+#define ROL8(x, n)	((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+
+// The Keccak-f[200] permutation of sponge[]. The lane x, y is sponge[x + 5 * y].
+static void keccak_f200(void)
+{
+	uint8_t c[7];	// c[5] and c[6] repeat c[0] and c[1], this saves a % 5
+	uint8_t round, x, y, t, u;
+
+	PROBE_HIGH(PROBE_SPONGE);
+	for (round = 0; round < 18; round++) {
+		// theta
+		for (x = 0; x < 5; x++)
+			c[x] = sponge[x] ^ sponge[x + 5] ^ sponge[x + 10] ^ sponge[x + 15] ^ sponge[x + 20];
+		c[5] = c[0];
+		c[6] = c[1];
+		for (x = 0; x < 5; x++) {
+			t = c[x + 4 - (x ? 5 : 0)] ^ ROL8(c[x + 1], 1);
+			for (y = 0; y < 25; y += 5)
+				sponge[x + y] ^= t;
+		}
+		// rho and pi
+		t = sponge[1];
+		for (x = 0; x < 24; x++) {
+			y = pgm_read_byte(&keccak_pi[x]);
+			u = sponge[y];
+			sponge[y] = ROL8(t, pgm_read_byte(&keccak_rot[x]));
+			t = u;
+		}
+		// chi
+		for (y = 0; y < 25; y += 5) {
+			for (x = 0; x < 5; x++)
+				c[x] = sponge[y + x];
+			c[5] = c[0];
+			c[6] = c[1];
+			for (x = 0; x < 5; x++)
+				sponge[y + x] = c[x] ^ (~c[x + 1] & c[x + 2]);
+		}
+		// iota
+		sponge[0] ^= pgm_read_byte(&keccak_rc[round]);
+	}
+	PROBE_LOW(PROBE_SPONGE);
+}
+
+// Absorb a raw byte. Returns 1 when CONDITION_RATE conditioned bytes are ready in sponge[].
+static uint8_t sponge_absorb(uint8_t b)
+{
+	sponge[sponge_pos] ^= b;
+	if (++sponge_pos < CONDITION_RATE)
+		return 0;
+	sponge_pos = 0;
+	keccak_f200();
+	if (++sponge_blocks < CONDITION_RATIO)
+		return 0;
+	sponge_blocks = 0;
+	return 1;
+}
+#endif
+
+#if defined(RAW_RICE) || defined(ADAPT)
+// floor(log2(x)), 0 for x = 0
+static uint8_t log2_floor(uint32_t x)
+{
+	uint8_t n = 0;
+
+	while (x >>= 1)
+		++n;
+	return n;
+}
+#endif
+
+#ifdef ADAPT
+// Choose the extraction for the next bytes from the mean interval, and tell the host if it changed.
+// Only called between bytes, while the ISR isn't collecting.
+static void adapt(void)
+{
+	uint32_t mean;
+	uint8_t k = 0;
+
+	cli();
+	mean = adapt_mean;
+	sei();
+	// A quarter of hysteresis, so the mode doesn't flap when the rate sits at the threshold
+	if (mean < (extract_bits ? ADAPT_BELOW + ADAPT_BELOW / 4 : ADAPT_BELOW)) {
+		k = log2_floor(mean);
+		k = k > ADAPT_MARGIN ? k - ADAPT_MARGIN : 0;
+		if (k > ADAPT_MAX_BITS)
+			k = ADAPT_MAX_BITS;
+		if (k < ADAPT_MIN_BITS)
+			k = 0;
+	}
+	if (k != extract_bits) {
+		extract_bits = k;
+		endline();		// it takes effect from the next byte, so it can't wait for the end of the line
+		uart_putstring_P((char *)PSTR("#mode "));
+		utoa(k, serbuf, 10);
+		uart_putstring(serbuf);
+		uart_putchar('\n');
+	}
+}
+#endif
+
+#ifdef CHANGE_DETECT
+// Report what the change detector found. Only called between bytes at the start of a line.
+static void change_report(void)
+{
+	uint8_t flags;
+	uint32_t mean;
+
+	cli();
+	flags = change_flags;
+	change_flags = 0;
+	mean = change_mean;
+	sei();
+	if (flags & CHANGE_UP)
+		uart_putstring_P((char *)PSTR("#rate up\n"));
+	if (flags & CHANGE_DOWN)
+		uart_putstring_P((char *)PSTR("#rate down\n"));
+	if (flags & CHANGE_MEAN) {
+		uart_putstring_P((char *)PSTR("#cpm "));
+		ultoa(60000UL * TICKS_PER_MS / (mean ? mean : 1), serbuf, 10);
+		uart_putstring(serbuf);
+		uart_putchar('\n');
+#ifdef ADAPT
+		// Follow the new rate now rather than after the running mean has caught up
+		adapt_mean = mean;
+		adapt();
+#endif
+	}
+}
+#endif
+
+#ifdef RADLOG
+// Move the events counted by the ISR into the current second, and the second into the current
+// period. If the main loop was held up for longer than a second, the events all go to the first.
+static void rad_tick(void)
+{
+	uint32_t now;
+	uint16_t count;
+
+	cli();
+	now = milliseconds;
+	sei();
+	while ((int32_t)(now - rad_second) >= 0) {
+		rad_second += 1000;
+		cli();
+		count = rad_count;
+		rad_count = 0;
+		sei();
+		rad_cps = count;
+		rad_sum += count;
+		if (++rad_seconds == RADLOG_PERIOD) {
+			rad_bin[rad_next] = rad_sum;
+			if (++rad_next == RADLOG_BINS)
+				rad_next = 0;
+			if (rad_full < RADLOG_BINS)
+				++rad_full;
+			rad_sum = 0;
+			rad_seconds = 0;
+			rad_due = 1;
+		}
+	}
+}
+
+// Send the radiation report. Only called at the start of a line.
+static void rad_report(void)
+{
+	uint32_t cpm = 0;
+	uint8_t i;
+
+	rad_due = 0;
+	for (i = 0; i < RADLOG_BINS; i++)
+		cpm += rad_bin[i];
+	if (rad_full < RADLOG_BINS)
+		cpm = cpm * RADLOG_BINS / rad_full;	// less than a minute since reset
+	uart_putstring_P((char *)PSTR("#rad CPS, "));
+	utoa(rad_cps, serbuf, 10);
+	uart_putstring(serbuf);
+	uart_putstring_P((char *)PSTR(", CPM, "));
+	ultoa(cpm, serbuf, 10);
+	uart_putstring(serbuf);
+	uart_putstring_P((char *)PSTR(", uSv/hr, "));
+	cpm = cpm * 100 / RADLOG_CPM_PER_USV;	// now hundredths of a uSv/h
+	ultoa(cpm / 100, serbuf, 10);
+	uart_putstring(serbuf);
+	i = cpm % 100;
+	uart_putchar('.');
+	uart_putchar('0' + i / 10);
+	uart_putchar('0' + i % 10);
+	uart_putchar('\n');
+}
+#endif
+
+#ifdef RAW_RICE
+// Send the low nbits of value, MSB first
+static void rice_put(uint32_t value, uint8_t nbits)
+{
+	uint32_t bit;
+
+	if (nbits == 0)
+		return;
+	for (bit = 1UL << (nbits - 1); bit; bit >>= 1) {
+		rice_acc <<= 1;
+		if (value & bit)
+			rice_acc |= 1;
+		if (++rice_bits == 8) {
+			uart_putbyte(rice_acc);
+			rice_bits = 0;
+		}
+	}
+}
+
+// Send an interval as a Rice code. ricedecode.py must follow exactly the same steps.
+static void rice_encode(uint32_t interval)
+{
+	uint32_t m;
+	uint8_t k, q;
+
+	if (rice_count == 0) {
+		// Start a frame
+		k = log2_floor(rice_mean);
+		rice_mean = 1UL << k;
+		rice_put((rice_seq << 5) | k, 8);
+		rice_seq = (rice_seq + 1) & 7;
+	}
+	// The best parameter for an exponential distribution is about log2(mean * ln 2)
+	m = rice_mean - (rice_mean >> 2) - (rice_mean >> 4);
+	k = log2_floor(m);
+	if ((interval >> k) >= RICE_ESCAPE) {
+		rice_put(0xffffffffUL, RICE_ESCAPE);
+		rice_put(interval, 32);
+	} else {
+		q = interval >> k;
+		while (q--)
+			rice_put(1, 1);
+		rice_put(0, 1);
+		rice_put(interval, k);
+	}
+	if (interval != 0L) {
+		if (interval > rice_mean)
+			rice_mean += (interval - rice_mean) >> 4;
+		else
+			rice_mean -= (rice_mean - interval) >> 4;
+	}
+	if (++rice_count == RICE_FRAME) {
+		// End of frame, pad to a whole byte
+		if (rice_bits)
+			rice_put(0, 8 - rice_bits);
+		rice_count = 0;
+	}
+}
+#endif
+
+#ifdef RAW_EVENTS
+// send the queued raw events over the serial port
+void sendraw(void)
+{
+	uint32_t interval;
+	uint16_t width;
+	uint8_t lost;
+
+	PROBE_HIGH(PROBE_REPORT);
+	while (raw_tail != raw_head) {
+		interval = raw_fifo[raw_tail % RAW_FIFO_LEN].interval;
+		width = raw_fifo[raw_tail % RAW_FIFO_LEN].width;
+		++raw_tail;		// the ISR may reuse the slot from here on
+#ifdef RAW_RICE
+		rice_encode(interval);
+		(void)width;
+#else
+		ultoa(interval, serbuf, 16);
+		uart_putstring(serbuf);
+#ifdef PULSE_WIDTH
+		uart_putchar(',');
+		ultoa(width, serbuf, 16);
+		uart_putstring(serbuf);
+#else
+		(void)width;
+#endif
+		uart_putchar('\n');
+#endif
+	}
+	if (raw_lost) {
+		cli();
+		lost = raw_lost;
+		raw_lost = 0;
+		sei();
+#ifdef RAW_RICE
+		rice_encode(0L);	// lost events are only marked, not counted
+		(void)lost;
+#else
+		uart_putstring_P((char *)PSTR("#lost "));
+		ultoa(lost, serbuf, 10);
+		uart_putstring(serbuf);
+		uart_putchar('\n');
+#endif
+	}
+	PROBE_LOW(PROBE_REPORT);
+}
+#endif
+
+#ifdef DEFER_EXTRACT
+// Turn the queued timestamps into bits, until a byte is complete. The ones after it are dropped
+// like the events during beep().
+static void collect_stamps(void)
+{
+	uint8_t tail;
+	uint16_t ms16, ticks;
+	uint8_t flags;
+	uint32_t now;
+
+	while ((tail = stamp_tail) != stamp_head && mode == MODE_COUNTING) {
+		ms16 = stamp_fifo[tail % STAMP_FIFO_LEN].ms;
+		ticks = stamp_fifo[tail % STAMP_FIFO_LEN].ticks;
+		flags = stamp_fifo[tail % STAMP_FIFO_LEN].flags;
+		stamp_tail = tail + 1;		// the ISR may reuse the slot from here on
+		cli();
+		now = milliseconds;
+		sei();
+		// The stamp is at most a few milliseconds old, or one ahead if ISR(TIMER1_COMPA_vect)
+		// hasn't run yet, so the low bits put it next to now
+		now += (int16_t)(ms16 - (uint16_t)now);
+		if (flags & STAMP_GAP)
+			collect_restart();
+		collect_event(now * TICKS_PER_MS + ticks, flags & STAMP_RISING);
+	}
+}
+
+#ifndef USI_SLAVE
+// Report lost events. Only called between bytes at the start of a line.
+static void stamp_report(void)
+{
+	uint8_t lost;
+
+	cli();
+	lost = stamp_lost;
+	stamp_lost = 0;
+	sei();
+	uart_putstring_P((char *)PSTR("#lost "));
+	utoa(lost, serbuf, 10);
+	uart_putstring(serbuf);
+	uart_putchar('\n');
+}
+#endif
+#endif
+
 // Flashes the LED and makes a beep
 //
 // Note that while we're in this routine, the ISR is ignoring counts.
@@ -383,12 +2187,13 @@ void sendreport(void)
 // determine a random bit.
 
 void beep(void) {
+	PROBE_HIGH(PROBE_BEEP);
 	PORTB |= _BV(PB4);	// turn on the LED
 
 #ifdef BEEP	
 	TCCR0A |= _BV(COM0A0);	// enable OCR0A output on pin PB2
-	TCCR0B |= _BV(CS01);	// set prescaler to clk/8 (1Mhz) or 1us/count
-	OCR0A = 160;	// 160 = toggle OCR0A every 160ms, period = 320us, freq= 3.125kHz
+	TCCR0B |= TONE_PRESCALE;	// set prescaler to 1us/count (4us on the ATmega328P)
+	OCR0A = TONE_TOP;	// toggle OCR0A every 160us, period = 320us, freq= 3.125kHz
 #endif
 		
 	// 10ms delay gives a nice short flash and 'click' on the piezo
@@ -399,23 +2204,57 @@ void beep(void) {
 		TCCR0B = 0;				// disable Timer0 since we're no longer using it
 	TCCR0A &= ~(_BV(COM0A0));	// disconnect OCR0A from Timer0, this avoids occasional HVPS whine after beep
 #endif
+	PROBE_LOW(PROBE_BEEP);
 }
 
 // Start of main program
 int main(void)
 {	
+#ifdef CONDITION
+	uint8_t i;
+#endif
+
 	// Configure the UART	
 	// Set baud rate generator based on F_CPU
+#ifdef UART_U2X
+	UCSRA = _BV(U2X);
+	UBRRH = (unsigned char)((F_CPU/(8UL*BAUD)-1)>>8);
+	UBRRL = (unsigned char)(F_CPU/(8UL*BAUD)-1);
+#else
 	UBRRH = (unsigned char)(F_CPU/(16UL*BAUD)-1)>>8;
 	UBRRL = (unsigned char)(F_CPU/(16UL*BAUD)-1);
+#endif
 	
 	// Enable USART transmitter and receiver
 	UCSRB = (1<<RXEN) | (1<<TXEN);
+#ifdef COMMANDS
+	UCSRB |= _BV(RXCIE);	// and the receive interrupt, for commands
+#endif
 	
 	// Set up AVR IO ports
-	DDRB = _BV(PB4) | _BV(PB2);  // set pins connected to LED and piezo as outputs
-	DDRD = _BV(PD6);	// configure PULSE output
+	DDRB = _BV(PB4);	// set pin connected to LED as output
+	PIEZO_DDR |= _BV(PIEZO_BIT);	// and the piezo
+	PULSE_DDR |= _BV(PULSE_BIT);	// configure PULSE output
+#ifdef INSTRUMENT
+	DDRD |= _BV(PD5) | _BV(PD4);	// spare pins used as probes
+	DDRB |= _BV(PB1) | _BV(PB3);
+#endif
 	PORTD |= _BV(PD3);	// enable internal pull up resistor on pin connected to button
+#ifdef USI_SPI
+	// USI in three wire mode, shifting on the master's clock: SPI mode 0 slave
+	USICR = _BV(USIOIE) | _BV(USIWM0) | _BV(USICS1);
+	PORTB |= _BV(PB0);	// pull up on slave select
+	PCMSK = _BV(PCINT0);	// slave select pin change interrupt
+	GIMSK |= _BV(PCIE);
+#endif
+#ifdef USI_TWI
+	// USI in two wire mode. SCL and SDA are open drain: the port bits stay high and the USI
+	// pulls the lines low. SCL is an output so that we can stretch the clock.
+	PORTB |= _BV(PB7) | _BV(PB5);
+	DDRB |= _BV(PB7);
+	twi_wait_for_start();
+	USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC);
+#endif
 	
 	// Initialize state
 	t1 = 0L;
@@ -424,15 +2263,40 @@ int main(void)
 	rand_byte = 0;
 	rand_mask = 0x01;
 	byte_count = 0;
+	line_count = 0;
 	mode = MODE_OFF;
+#ifdef COMMANDS
+	eeprom_read_block(&config, &ee_config, sizeof(config));
+	if (config.magic != CONFIG_MAGIC)
+#endif
+	{
+		config.magic = CONFIG_MAGIC;
+		config.batch = RAND_CHARS;
+		config.line = RAND_CHARS;
+		config.term = TERM_CRLF;
+	}
+#ifdef RAW_RICE
+	rice_mean = 1UL << 16;	// 65 ms, about 900 CPM
+#endif
+#ifdef ADAPT
+	adapt_mean = 2 * ADAPT_BELOW;	// start with comparisons
+#endif
 	
 	// Set up external interrupts	
 	// INT0 is triggered by a GM impulse
 	// INT1 is triggered by pushing the button
-	MCUCR |= _BV(ISC01);	// Config interrupts on falling edge of INT0
+	// (or Timer1 input capture, with GEIGER_ICP)
+#if defined(GEIGER_ICP)
+	PORTB |= _BV(PB0);		// pull up on ICP1, like the kit's resistor on INT0
+#elif defined(PULSE_WIDTH)
+	EXT_INT_CTRL |= _BV(ISC00);	// Config interrupts on both edges of INT0
 	GIMSK |= _BV(INT0);		// Enable external interrupts on pin INT0
+#else
+	EXT_INT_CTRL |= _BV(ISC01);	// Config interrupts on falling edge of INT0
+	GIMSK |= _BV(INT0);		// Enable external interrupts on pin INT0
+#endif
 #ifndef CONTINUOUS
-	MCUCR |= _BV(ISC11);	// Config interrupts on falling edge of INT1
+	EXT_INT_CTRL |= _BV(ISC11);	// Config interrupts on falling edge of INT1
 	GIMSK |= _BV(INT1);	// Enable external interrupts on pin INT1
 #endif
 	
@@ -444,12 +2308,22 @@ int main(void)
 
 	// Set up Timer1 for 1 millisecond interrupts
 	TCCR1B = _BV(WGM12) | _BV(CS11);  // CTC mode, prescaler = 8 (1us ticks)
-	OCR1A = 1000;	// 1 us * 1000 = 1 ms
+	OCR1A = TICKS_PER_MS - 1;	// 1 us * 1000 = 1 ms, counting from 0 to 999
 	TIMSK = _BV(OCIE1A);  // Timer1 overflow interrupt enable
+#ifdef GEIGER_ICP
+	TIMSK |= _BV(ICIE1);	// Timer1 input capture on the falling edge (ICES1 = 0)
+#endif
+#ifdef WDT_JITTER
+	// Watchdog in interrupt mode, no reset, every 16 ms. The prescaler can only be changed
+	// within 4 cycles of setting WDCE.
+	wdt_reset();
+	WDTCSR = _BV(WDCE) | _BV(WDE);
+	WDTCSR = _BV(WDIE);
+#endif
 	
 	sei();	// Enable interrupts
 	
-#ifdef CONTINUOUS
+#if defined(CONTINUOUS) || defined(USI_SLAVE)
 	// If we are counting continuously, then start now
 	mode = MODE_COUNTING; // Tell the interrupt to start counting
 #endif
@@ -466,17 +2340,75 @@ int main(void)
 		
 		sleep_disable();	// disable sleep so we don't accidentally go to sleep
 		
+#ifdef COMMANDS
+		if (cmd_ready)
+			command();
+#endif
+#ifdef RAW_EVENTS
+		sendraw();		// we never get to MODE_DONE in this mode
+#endif
+#ifdef DEFER_EXTRACT
+		collect_stamps();
+#endif
+#ifdef RADLOG
+		rad_tick();
+		if (rad_due && report_ok())
+			rad_report();
+#endif
+#ifdef USI_SLAVE
+		// Resume counting once the master has made room in the buffer
+		if (mode == MODE_OFF && (uint8_t)(USI_BUF_LEN - (usi_head - usi_tail)) >= OUT_CHUNK)
+			mode = MODE_COUNTING;
+#endif
 		while (mode == MODE_DONE) {
-			sendreport();
+#ifdef CONDITION
+			if (sponge_absorb(rand_byte))
+				for (i = 0; i < CONDITION_RATE; i++)
+					putrandom(sponge[i]);
+#else
+			putrandom(rand_byte);
+#endif
 			beep();
-			t1 = 0L;
-			t2 = 0L;
-			t3 = 0L;
+			collect_restart();	// an interval across beep() would be too long
 			rand_byte = 0;
-			++byte_count;
-			if (byte_count == RAND_CHARS) {
-				uart_putchar('\n');	
-				byte_count = 0;
+#ifdef DEFER_EXTRACT
+			// Drop what was queued after the byte, the ISR doesn't queue more until we count again
+			stamp_tail = stamp_head;
+			stamp_gap = 0;
+#endif
+#ifdef ADAPT
+			if (batch_done || (config.batch == 0 && ++adapt_count == 0))
+				adapt();
+#endif
+#ifdef CHANGE_DETECT
+			if (change_flags && report_ok())
+				change_report();
+#endif
+#if defined(DEFER_EXTRACT) && !defined(USI_SLAVE)
+			if (stamp_lost && report_ok())
+				stamp_report();
+#endif
+#ifdef WDT_JITTER
+			// The bits completed so far may go into the next byte, whose events are all to come
+			wdt_share = 0;
+			cli();
+			wdt_ready = wdt_nbits;
+			sei();
+#ifndef USI_SLAVE
+			if (wdt_flags && report_ok()) {
+				wdt_flags = 0;
+				uart_putstring_P((char *)PSTR("#wdt fail\n"));
+			}
+#endif
+#endif
+#ifdef USI_SLAVE
+			if ((uint8_t)(USI_BUF_LEN - (usi_head - usi_tail)) < OUT_CHUNK)
+				mode = MODE_OFF;	// full, wait for the master
+			else
+				mode = MODE_COUNTING;
+#else
+			if (batch_done) {
+				batch_done = 0;
 #ifdef CONTINUOUS
 				mode = MODE_COUNTING;
 #else
@@ -485,6 +2417,7 @@ int main(void)
 			} else {
 				mode = MODE_COUNTING;
 			}
+#endif
 		}
 	
 	}	
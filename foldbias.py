@@ -0,0 +1,54 @@
+# Bias and throughput of the PARITY_FOLD extractor, estimated from one capture.
+#
+# Usage: python foldbias.py [cpm] < putty.log
+#
+# The capture must come from firmware built with PARITY_FOLD = 1 (the default), in the
+# usual hex output format. The firmware XORs every byte with 0xaa, so that is undone
+# first to get the raw comparison bits, in the order they were collected (LSB first).
+# Then, for k = 1 to 4, every k raw bits are folded into one bit exactly as PARITY_FOLD = k
+# would, and the bias of the result is printed next to the bias predicted from the raw
+# bits, with the MCV min-entropy per bit and the throughput at the given count rate
+# (600 CPM if not given). The prediction assumes independent raw bits; if the measured
+# bias is far from it, neighbouring raw bits are correlated.
+from __future__ import division, print_function
+
+import sys
+
+from minentropy import mcv
+
+EVENTS_PER_BIT = 4      # events per comparison, without PULSE_WIDTH
+
+def read_bits(input):
+    bits = []
+    for line in input:
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
+        for i in range(0, len(line) - 1, 2):
+            b = int(line[i:i+2], 16) ^ 0xaa
+            bits.extend((b >> j) & 1 for j in range(8))
+    return bits
+
+def fold(bits, k):
+    return [sum(bits[i:i+k]) & 1 for i in range(0, len(bits) - k + 1, k)]
+
+def main(input, cpm):
+    raw = read_bits(input)
+    if not raw:
+        print('no data in capture')
+        return
+    e = sum(raw) / len(raw) - 0.5
+    print('%d raw bits, raw bias %+.5f' % (len(raw), e))
+    print()
+    print('%2s %9s %10s %10s %8s %9s %10s' % ('k', 'bits', 'bias', 'predicted', 'H/bit',
+                                             'events/B', 'bytes/min'))
+    for k in range(1, 5):
+        bits = fold(raw, k)
+        bias = sum(bits) / len(bits) - 0.5
+        predicted = -(-2 * e) ** k / 2     # piling-up lemma
+        events = 8 * k * EVENTS_PER_BIT
+        print('%2d %9d %+10.5f %+10.5f %8.5f %9d %10.2f' % (k, len(bits), bias, predicted,
+                                                        mcv(bits), events, cpm / events))
+
+if __name__ == '__main__':
+    main(sys.stdin, float(sys.argv[1]) if len(sys.argv) > 1 else 600.0)
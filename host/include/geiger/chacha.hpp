@@ -0,0 +1,56 @@
+/*
+	geiger::ChaCha20 - a ChaCha20 keystream for filling large buffers from a Geiger seed
+
+	The generator's few hundred bytes a second are plenty to seed a DRBG but nowhere near
+	enough for jobs that need gigabytes. A ChaCha20 key taken from the generator gives as much
+	output as is needed, and since block i of the keystream depends only on the key, the nonce
+	and i, any range of it can be computed on its own: bulk_fill() gives each thread its own
+	range of block counters and the result is the same for any number of threads.
+
+		geiger::ChaCha20 c(key);			// 32 bytes, eg. read from a Source
+		geiger::bulk_fill(c, buffer);		// on every core
+
+	The state uses Bernstein's original layout, a 64 bit block counter followed by a 64 bit
+	nonce. For counters below 2^32 that is the RFC 7539 state with the 96 bit nonce starting
+	with four zero bytes, so the RFC test vectors apply.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace geiger {
+
+class ChaCha20 {
+public:
+	static constexpr std::size_t key_bytes = 32;
+	static constexpr std::size_t block_bytes = 64;
+
+	// The nonce is the last two state words, little endian
+	explicit ChaCha20(std::span<const std::byte, key_bytes> key, std::uint64_t nonce = 0);
+
+	// Fill out with the keystream from block number first_block on. A partial block at the end
+	// gets the start of that block.
+	void generate(std::span<std::byte> out, std::uint64_t first_block = 0) const;
+
+	// The kernel in use, "avx2" or "generic"
+	const char *kernel() const noexcept;
+
+private:
+	std::uint32_t state_[16];
+	bool avx2_;
+};
+
+// Fill out with the keystream from block first_block on, split into one range of blocks per
+// thread. threads = 0 uses every core.
+void bulk_fill(const ChaCha20 &c, std::span<std::byte> out, unsigned threads = 0,
+	std::uint64_t first_block = 0);
+
+} // namespace geiger
@@ -0,0 +1,176 @@
+/*
+	geiger::extract - the firmware's extraction steps as batch loops over interval traces
+
+	Built from the same functions as the firmware (GeigerExtract.h in the top directory), so
+	that offline reprocessing and simulations give the bits the firmware would have given. A
+	trace is an array of intervals between consecutive Geiger events, in timer ticks, as
+	exported by RAW_EVENTS or RAW_RICE (ricedecode.py -u32).
+
+	An extractor is a chain of policies. The first turns intervals into bits, the others turn
+	bits into fewer bits:
+
+		Compare<>		the firmware's comparison, one bit per four events, ties give 0
+		Compare<true>	the same, ties are discarded (as PULSE_WIDTH does)
+		LowBits<k>		the low k bits of every interval (ADAPT)
+		VonNeumann		von Neumann's extractor on pairs of bits
+		ParityFold<k>	the parity of every k bits (PARITY_FOLD)
+
+		using Folded = geiger::extract::Chain<Compare<>, ParityFold<2>>;
+		std::vector<geiger::extract::Bit> bits(Folded::max_bits(trace.size()));
+		bits.resize(Folded::run(trace, bits));
+
+	Bits are kept one per byte, 0 or 1, so the loops vectorise; pack() turns them into the
+	bytes the firmware would send. The firmware also drops the events that arrive while it
+	sends a byte, which a trace doesn't record, so the bit streams line up only within a byte.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include "GeigerExtract.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace geiger::extract {
+
+using Bit = std::uint8_t;
+
+// Interval policies
+
+// gx_compare() of the 1st and 3rd of every four intervals: events t1..t4 make one bit, and the
+// firmware starts the next bit at the event after t4. DiscardTies uses gx_compare_tie().
+template <bool DiscardTies = false>
+struct Compare {
+	static std::string name() { return DiscardTies ? "compare-ties" : "compare"; }
+	static constexpr std::size_t max_bits(std::size_t intervals) { return intervals / 4; }
+
+	static std::size_t run(std::span<const std::uint32_t> iv, std::span<Bit> out)
+	{
+		const std::size_t steps = iv.size() / 4;
+		const std::uint32_t *p = iv.data();
+		Bit *o = out.data();
+
+		if constexpr (!DiscardTies) {
+			for (std::size_t i = 0; i < steps; i++)
+				o[i] = gx_compare(p[4 * i], p[4 * i + 2]);
+			return steps;
+		} else {
+			std::size_t n = 0;
+			for (std::size_t i = 0; i < steps; i++) {
+				Bit b = gx_compare_tie(p[4 * i], p[4 * i + 2]);
+				o[n] = b;
+				n += b != GX_NONE;
+			}
+			return n;
+		}
+	}
+};
+
+// gx_low_bit() 0..K-1 of every interval, lowest first
+template <unsigned K>
+struct LowBits {
+	static_assert(K >= 1 && K <= 32);
+	static std::string name() { return "low" + std::to_string(K); }
+	static constexpr std::size_t max_bits(std::size_t intervals) { return intervals * K; }
+
+	static std::size_t run(std::span<const std::uint32_t> iv, std::span<Bit> out)
+	{
+		const std::uint32_t *p = iv.data();
+		Bit *o = out.data();
+
+		for (std::size_t i = 0; i < iv.size(); i++)
+			for (unsigned j = 0; j < K; j++)
+				o[K * i + j] = gx_low_bit(p[i], static_cast<std::uint8_t>(j));
+		return iv.size() * K;
+	}
+};
+
+// Bit policies. They work in place: bits[0..n) becomes bits[0..returned).
+
+// gx_von_neumann() on every pair of bits
+struct VonNeumann {
+	static std::string name() { return "vn"; }
+	static constexpr std::size_t max_bits(std::size_t bits) { return bits / 2; }
+
+	static std::size_t run(std::span<Bit> bits)
+	{
+		Bit *b = bits.data();
+		std::size_t n = 0;
+
+		for (std::size_t i = 0; i + 1 < bits.size(); i += 2) {
+			Bit v = gx_von_neumann(b[i], b[i + 1]);
+			b[n] = v;
+			n += v != GX_NONE;
+		}
+		return n;
+	}
+};
+
+// gx_fold() of every K bits. The loop computes the same parity without the state.
+template <unsigned K>
+struct ParityFold {
+	static_assert(K >= 1);
+	static std::string name() { return "fold" + std::to_string(K); }
+	static constexpr std::size_t max_bits(std::size_t bits) { return bits / K; }
+
+	static std::size_t run(std::span<Bit> bits)
+	{
+		const std::size_t n = bits.size() / K;
+		Bit *b = bits.data();
+
+		for (std::size_t i = 0; i < n; i++) {
+			Bit parity = 0;
+			for (unsigned j = 0; j < K; j++)
+				parity ^= b[K * i + j];
+			b[i] = parity;
+		}
+		return n;
+	}
+};
+
+// An interval policy followed by any number of bit policies
+template <class First, class... Rest>
+struct Chain {
+	static std::string name()
+	{
+		std::string s = First::name();
+		((s += '+', s += Rest::name()), ...);
+		return s;
+	}
+
+	// Size of the bits buffer run() needs
+	static constexpr std::size_t max_bits(std::size_t intervals) { return First::max_bits(intervals); }
+
+	// Extract from iv into bits, returns the number of bits
+	static std::size_t run(std::span<const std::uint32_t> iv, std::span<Bit> bits)
+	{
+		std::size_t n = First::run(iv, bits);
+		((n = Rest::run(bits.first(n))), ...);
+		return n;
+	}
+};
+
+// Pack bits into bytes the way the firmware does: LSB first, then XOR with GX_FLIP. Returns the
+// number of bytes, a partial byte at the end is left out.
+inline std::size_t pack(std::span<const Bit> bits, std::span<std::byte> out)
+{
+	const std::size_t n = bits.size() / 8;
+	const Bit *b = bits.data();
+
+	for (std::size_t i = 0; i < n; i++) {
+		unsigned v = 0;
+		for (unsigned j = 0; j < 8; j++)
+			v |= static_cast<unsigned>(b[8 * i + j]) << j;
+		out[i] = static_cast<std::byte>(v ^ GX_FLIP);
+	}
+	return n;
+}
+
+} // namespace geiger::extract
@@ -0,0 +1,61 @@
+/*
+	geiger::HealthTest - the continuous health tests of NIST SP 800-90B for one byte stream
+
+	The repetition count test (4.4.1) fails when a byte repeats too often in a row, the
+	adaptive proportion test (4.4.2) when the first byte of a window of 512 turns up too often
+	in it. Both catch a source that has got stuck or lost most of its entropy, and both are set
+	from the min-entropy the source was assessed at, for a false alarm probability of 2^-20 per
+	byte. geigerd runs them on every device's bytes before they reach the pool.
+
+		geiger::HealthTest t(0.9);			// min-entropy per bit
+		if (t.run(chunk) != geiger::HealthTest::Result::ok)
+			...								// quarantine the source
+
+	The state carries over from one chunk to the next, so chunks can be of any size. Both tests
+	look at every byte once, at a few cycles per byte.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace geiger {
+
+class HealthTest {
+public:
+	enum class Result : std::uint8_t { ok, repetition, proportion };
+
+	static constexpr unsigned apt_window = 512;
+
+	// h is the assessed min-entropy per bit, 0 < h <= 1
+	explicit HealthTest(double h);
+
+	// Test the next bytes of the stream and return the first failure among them. After a
+	// failure the state starts over and the rest of the bytes are still tested, so the state
+	// is the same however the stream is cut into chunks.
+	Result run(std::span<const std::byte> bytes) noexcept;
+
+	unsigned rct_cutoff() const noexcept { return rct_cutoff_; }
+	unsigned apt_cutoff() const noexcept { return apt_cutoff_; }
+
+	static const char *name(Result r) noexcept;
+
+private:
+	unsigned rct_cutoff_, apt_cutoff_;
+	// Repetition count: the last byte and how often it came in a row
+	std::uint8_t rct_value_ = 0;
+	unsigned rct_count_ = 0;
+	// Adaptive proportion: the first byte of the window, how often it came, bytes seen
+	std::uint8_t apt_value_ = 0;
+	unsigned apt_count_ = 0;
+	unsigned apt_seen_ = 0;
+};
+
+} // namespace geiger
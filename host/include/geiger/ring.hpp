@@ -0,0 +1,79 @@
+/*
+	geiger::ByteRing - a fixed size FIFO of bytes, allocated once
+
+	Writers fill the free space in place through write_span()/commit(), readers take bytes
+	out with pop() or look at them in place with read_spans() and drop(). Not thread safe.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+
+namespace geiger {
+
+class ByteRing {
+public:
+	explicit ByteRing(std::size_t capacity)
+		: buf_(std::make_unique<std::byte[]>(capacity)), cap_(capacity) {}
+
+	std::size_t capacity() const noexcept { return cap_; }
+	std::size_t size() const noexcept { return size_; }
+	std::size_t space() const noexcept { return cap_ - size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	bool full() const noexcept { return size_ == cap_; }
+
+	// The contiguous free space after the newest byte. Write into it, then commit().
+	std::span<std::byte> write_span() noexcept
+	{
+		std::size_t tail = (head_ + size_) % cap_;
+		std::size_t n = tail >= head_ && size_ != cap_ ? cap_ - tail : head_ - tail;
+		return { buf_.get() + tail, n };
+	}
+
+	void commit(std::size_t n) noexcept { size_ += n; }
+
+	// The buffered bytes, oldest first, in at most two pieces
+	std::array<std::span<const std::byte>, 2> read_spans() const noexcept
+	{
+		std::size_t first = std::min(size_, cap_ - head_);
+		return { std::span<const std::byte>(buf_.get() + head_, first),
+			std::span<const std::byte>(buf_.get(), size_ - first) };
+	}
+
+	// Forget the n oldest bytes
+	void drop(std::size_t n) noexcept
+	{
+		head_ = (head_ + n) % cap_;
+		size_ -= n;
+	}
+
+	// Copy up to out.size() of the oldest bytes into out and drop them. Returns the count.
+	std::size_t pop(std::span<std::byte> out) noexcept
+	{
+		std::size_t n = std::min(out.size(), size_);
+		auto spans = read_spans();
+		std::size_t first = std::min(n, spans[0].size());
+		std::memcpy(out.data(), spans[0].data(), first);
+		std::memcpy(out.data() + first, spans[1].data(), n - first);
+		drop(n);
+		return n;
+	}
+
+private:
+	std::unique_ptr<std::byte[]> buf_;
+	std::size_t cap_;
+	std::size_t head_ = 0;		// oldest byte
+	std::size_t size_ = 0;
+};
+
+} // namespace geiger
@@ -0,0 +1,109 @@
+/*
+	geiger::SeenIndex - a persistent index of the random bytes that have been handed out
+
+	With captures, replays and reserve files around, the same bytes could be served twice, eg.
+	when a capture is imported again. The stream is cut into chunks where its content says so
+	(Chunker), not at fixed offsets, so a copy that starts at a different offset still gives
+	the same chunks after the first one. Every chunk's keyed SipHash goes into a cuckoo filter
+	kept in a memory mapped file: checking or adding a chunk looks at two buckets of four 32 bit
+	fingerprints, whatever the size of the index.
+
+		auto index = geiger::SeenIndex::open("served.idx", 1 << 24);	// created if missing
+		geiger::Chunker chunker(index.chunk_log2());
+		...
+		if (std::size_t n = chunker.next(bytes))		// a chunk ends after n bytes
+			fresh = index.insert(chunk);				// false: seen before, drop it
+		...
+		index.sync();									// before any fresh chunk goes out
+
+	The index holds a fixed number of chunks, set when it is made, and takes 4 bytes per chunk:
+	with the default 4 KiB chunks, 1 GiB of index covers about a terabyte of output. It is
+	locked while open, so only one program writes it at a time. A chunk that wasn't seen is
+	reported as seen with a probability of about 2^-28 (8 candidate slots for a 31 bit
+	fingerprint), never the other way round.
+
+	insert() only changes the mapping. Call sync() before handing out the chunks it accepted:
+	after a crash or a power loss the index only remembers what was synced.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace geiger {
+
+// Content defined chunking with a gear hash: a chunk ends where the top avg_log2 bits of the
+// hash of the last 64 bytes are zero, after at least a quarter of 2^avg_log2 bytes, so chunks
+// are about 2^avg_log2 bytes. None is longer than four times that.
+class Chunker {
+public:
+	explicit Chunker(unsigned avg_log2 = 12);
+
+	// Scan the next bytes of the stream. Returns the number of them up to and including the end
+	// of the current chunk, or 0 if the chunk doesn't end in bytes (all of them were scanned).
+	std::size_t next(std::span<const std::byte> bytes) noexcept;
+
+	// Forget the current chunk, the next byte starts a new one
+	void reset() noexcept { hash_ = 0; len_ = 0; }
+
+	std::size_t max_chunk() const noexcept { return max_; }
+
+private:
+	unsigned shift_;
+	std::size_t min_, max_;
+	std::uint64_t hash_ = 0;
+	std::size_t len_ = 0;		// bytes in the current chunk so far
+};
+
+class SeenIndex {
+public:
+	// Open an index, or create one for capacity chunks of 2^chunk_log2 bytes on average if it
+	// doesn't exist and capacity isn't 0
+	static SeenIndex open(const std::string &path, std::uint64_t capacity = 0, unsigned chunk_log2 = 12);
+
+	SeenIndex(SeenIndex &&other) noexcept;
+	SeenIndex &operator=(SeenIndex &&other) noexcept;
+	SeenIndex(const SeenIndex &) = delete;
+	SeenIndex &operator=(const SeenIndex &) = delete;
+	~SeenIndex();
+
+	// Add a chunk. Returns false if it was there already. Throws std::length_error when full.
+	bool insert(std::span<const std::byte> chunk);
+
+	// Write the chunks added so far to disk. Throws std::system_error if that fails.
+	void sync();
+
+	// Whether a chunk is there
+	bool contains(std::span<const std::byte> chunk) const noexcept;
+
+	std::uint64_t size() const noexcept;
+	std::uint64_t capacity() const noexcept;
+	unsigned chunk_log2() const noexcept;
+
+private:
+	struct Header;
+
+	SeenIndex(int fd, void *map, std::size_t bytes) noexcept;
+
+	std::uint64_t hash(std::span<const std::byte> chunk) const noexcept;
+	void close() noexcept;
+
+	int fd_ = -1;
+	void *map_ = nullptr;
+	std::size_t bytes_ = 0;
+	Header *header_ = nullptr;
+	std::uint32_t *slots_ = nullptr;
+	std::uint64_t mask_ = 0;		// buckets - 1
+	std::uint64_t rng_ = 0;			// picks the fingerprint to evict
+	bool dirty_ = false;			// inserted since the last sync()
+};
+
+} // namespace geiger
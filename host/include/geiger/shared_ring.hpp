@@ -0,0 +1,53 @@
+/*
+	geiger::SharedRing - the shared memory geigerd and a client exchange random bytes through
+
+	A client that reads small amounts often can ask geigerd for a ring of its own instead of
+	sending a request for every read (Source::connect_shared()). geigerd makes a memfd with this
+	header in the first page and the ring after it, at shared_ring_offset, and passes it to the
+	client with two eventfds. From then on geigerd copies bytes from its pool into the ring
+	whenever there is space, and the client takes them out without a system call.
+
+	There is one writer (geigerd) and one reader (the client). head and tail count the bytes
+	written and read since the ring was made, so head - tail bytes are ready, at index
+	tail % size. A side that runs out sets its waiting flag, checks again and then sleeps on
+	its eventfd; the other side clears the flag and writes the eventfd once:
+
+	- the client sets reader_waiting when the ring is empty, geigerd wakes it on data_fd,
+	- geigerd sets writer_waiting when the ring is full, the client wakes it on space_fd once
+	  half the ring is free, so a client doing small reads costs geigerd one wakeup per half
+	  ring rather than one per read.
+
+	Both processes map the same memory, so the atomics have to be lock free.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace geiger {
+
+struct SharedRing {
+	// geigerd's side
+	alignas(64) std::atomic<std::uint64_t> head;
+	std::atomic<std::uint32_t> writer_waiting;
+	// The client's side
+	alignas(64) std::atomic<std::uint64_t> tail;
+	std::atomic<std::uint32_t> reader_waiting;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free &&
+	std::atomic<std::uint32_t>::is_always_lock_free);
+
+// The ring starts on the second page. Its size is a power of two between these.
+inline constexpr std::size_t shared_ring_offset = 4096;
+inline constexpr std::size_t min_shared_ring = 4096;
+inline constexpr std::size_t max_shared_ring = 1u << 20;
+
+} // namespace geiger
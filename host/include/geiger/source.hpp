@@ -0,0 +1,165 @@
+/*
+	geiger::Source - random bytes from a GeigerRNG
+
+	A Source reads either straight from the serial port the firmware prints its hex to, or
+	from geigerd, the local entropy service that owns the serial port and shares it between
+	programs. Either way the bytes end up in a buffer the caller owns:
+
+		auto src = geiger::Source::connect();
+		std::array<std::byte, 32> seed;
+		src.read(seed);
+
+	read() waits until the buffer is full, read_some() takes what is there right now and
+	never waits, and read(buf, on_chunk) fills the buffer while handing every piece to
+	on_chunk as soon as it arrives. None of them allocate. With geigerd the bytes are
+	received from the socket directly into the caller's buffer; from a serial port the hex
+	text is decoded straight into it.
+
+	A program that reads a few bytes at a time and often can use connect_shared() instead of
+	connect(). geigerd then keeps a ring in memory shared with the client topped up (see
+	include/geiger/shared_ring.hpp), and reads copy from the ring into the buffer without a
+	system call, unless they have to wait for the generator.
+
+	The socket lives in a directory other users can't write to, $XDG_RUNTIME_DIR when it is set
+	and /run/geigerd otherwise, and connect() checks that the process at the other end runs as
+	root or as the caller, or as the user given, so no other local user can pose as geigerd.
+
+	A Source owns its file descriptor: it can be moved but not copied, and closes the
+	descriptor when destroyed. It is not thread safe, use one per thread. Errors are
+	reported as std::system_error.
+
+	The firmware's status lines, those starting with '#' such as the "#rad" radiation reports,
+	never reach the buffer. A serial Source can pass them to a handler set with on_status()
+	instead, as a view of its own read buffer, so the random bytes and the reports are split
+	without copying either. Only a line that straddles two reads is put together in a small
+	buffer first.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include <sys/types.h>
+
+namespace geiger {
+
+// $XDG_RUNTIME_DIR/geigerd.sock for a user's own geigerd, /run/geigerd/geigerd.sock for root
+// and when XDG_RUNTIME_DIR isn't set
+std::string default_socket();
+
+// For connect(): accept a geigerd running as root or as the caller
+inline constexpr uid_t root_or_self = static_cast<uid_t>(-1);
+
+// How long a read may wait for the generator
+enum class Wait : std::uint8_t {
+	none = 0,	// take what is available now, possibly nothing
+	some = 1,	// wait for at least one byte
+	all = 2,	// wait until the buffer is full
+};
+
+// geigerd protocol: the client sends a 32 bit little endian request, the number of bytes it
+// wants with the Wait in the top two bits. geigerd answers with a 32 bit little endian count
+// followed by that many bytes.
+//
+// With request_shared in the top two bits instead of a Wait, the count is the size of a shared
+// ring the client wants. geigerd answers with the size it made (a power of two) and passes a
+// memfd holding the ring and the data and space eventfds, in that order, with SCM_RIGHTS. The
+// connection then carries no more requests, closing it ends the ring.
+inline constexpr std::uint32_t request_count_mask = 0x3fffffff;
+inline constexpr int request_wait_shift = 30;
+inline constexpr std::uint32_t request_shared = 3;
+inline constexpr std::uint32_t max_request = 1u << 20;
+
+struct SharedRing;
+
+class Source {
+public:
+	// Open the firmware's serial port. Lines starting with '#' (status reports) are skipped.
+	static Source open_serial(const std::string &path, unsigned baud = 9600);
+	// Connect to geigerd, which has to run as server_uid
+	static Source connect(const std::string &socket_path = default_socket(), uid_t server_uid = root_or_self);
+	// Connect to geigerd and read through a shared ring of at least ring_bytes
+	static Source connect_shared(const std::string &socket_path = default_socket(),
+		std::size_t ring_bytes = 4096, uid_t server_uid = root_or_self);
+
+	Source(Source &&other) noexcept;
+	Source &operator=(Source &&other) noexcept;
+	Source(const Source &) = delete;
+	Source &operator=(const Source &) = delete;
+	~Source();
+
+	// Fill all of out, waiting for the generator as long as it takes
+	void read(std::span<std::byte> out) { fill(out, Wait::all); }
+
+	// Fill as much of out as is available right now. Returns the number of bytes.
+	std::size_t read_some(std::span<std::byte> out) { return fill(out, Wait::none); }
+
+	// Fill all of out, calling on_chunk(std::span<const std::byte>) for every piece as it lands
+	template <class F>
+	void read(std::span<std::byte> out, F &&on_chunk)
+	{
+		while (!out.empty()) {
+			std::size_t n = fill(out, Wait::some);
+			on_chunk(std::span<const std::byte>(out.first(n)));
+			out = out.subspan(n);
+		}
+	}
+
+	bool is_serial() const noexcept { return kind_ == Kind::serial; }
+
+	// Serial only: call fn(std::string_view) with every status line, '#' included and the line
+	// end left out, as it is read. The view is only valid during the call. Lines longer than
+	// max_status are cut short.
+	static constexpr std::size_t max_status = 128;
+	void on_status(std::function<void(std::string_view)> fn) { status_ = std::move(fn); }
+
+	// The file descriptor, for poll() on a serial Source: readable when read_some() may find data
+	int native_handle() const noexcept { return fd_; }
+
+private:
+	enum class Kind : std::uint8_t { serial, service, shared };
+
+	Source(int fd, Kind kind) noexcept : fd_(fd), kind_(kind) {}
+
+	std::size_t fill(std::span<std::byte> out, Wait wait);
+	std::size_t fill_serial(std::span<std::byte> out, Wait wait);
+	std::size_t fill_service(std::span<std::byte> out, Wait wait);
+	std::size_t fill_shared(std::span<std::byte> out, Wait wait);
+	std::size_t decode(std::span<std::byte> out);
+	void status_line();
+	void carry_status() noexcept;
+	void release() noexcept;
+
+	int fd_ = -1;
+	Kind kind_;
+	// Shared ring only: the mapping, its size without the header, and the eventfds
+	SharedRing *ring_ = nullptr;
+	std::size_t ring_size_ = 0;
+	int data_fd_ = -1;
+	int space_fd_ = -1;
+	// Serial only: hex text read but not decoded yet, because out was full
+	std::array<char, 512> text_;
+	std::uint16_t text_pos_ = 0;
+	std::uint16_t text_len_ = 0;
+	std::int8_t nibble_ = -1;	// high nibble of a byte split across reads, -1 if none
+	bool comment_ = false;		// in a '#' line
+	// Status lines: where the current one starts in text_, and its beginning if it started in an
+	// earlier read
+	std::function<void(std::string_view)> status_;
+	std::uint16_t line_start_ = 0;
+	std::uint16_t line_len_ = 0;
+	std::array<char, max_status> line_;
+};
+
+} // namespace geiger
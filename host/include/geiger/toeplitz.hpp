@@ -0,0 +1,60 @@
+/*
+	geiger::Toeplitz - a seeded Toeplitz hash extractor
+
+	Takes blocks of n raw bits with at least h bits of min-entropy per bit and turns each into
+	m nearly uniform bits, y = T x over GF(2), where T is the m x n Toeplitz matrix given by
+	n + m - 1 seed bits. By the leftover hash lemma the output is within 2^-security of
+	uniform when m = n h - 2 security, which output_bits() computes. The seed has to be
+	uniformly random and independent of the Geiger data, but it doesn't have to be secret and
+	can be reused for every block.
+
+	The product is the middle part of the carry-less product of seed and block, computed 64
+	bits at a time with PCLMULQDQ where the CPU has it, and with a portable version otherwise.
+	Bits are taken LSB first from each byte, the same order the firmware collects them in.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace geiger {
+
+class Toeplitz {
+public:
+	// m for n input bits with min-entropy h per bit, for output within 2^-security of uniform,
+	// rounded down to whole bytes. 0 if there is too little entropy.
+	static std::size_t output_bits(std::size_t n, double h, unsigned security = 64);
+
+	// n and m in bits, n a multiple of 64 and m a multiple of 8. The seed must hold at least
+	// seed_bytes(n, m) bytes.
+	Toeplitz(std::size_t n, std::size_t m, std::span<const std::byte> seed);
+
+	static std::size_t seed_bytes(std::size_t n, std::size_t m) { return (n + m - 1 + 7) / 8; }
+
+	std::size_t input_bytes() const noexcept { return n_ / 8; }
+	std::size_t output_bytes() const noexcept { return m_ / 8; }
+
+	// Extract every whole block of in into out, which needs output_bytes() per block.
+	// Returns the number of blocks.
+	std::size_t extract(std::span<const std::byte> in, std::span<std::byte> out) const;
+
+	// The kernel in use, "pclmul" or "portable"
+	const char *kernel() const noexcept;
+
+private:
+	std::size_t n_, m_;
+	std::vector<std::uint64_t> seed_;	// n + m - 1 bits, with zero padding on both sides
+	std::size_t pad_;
+	std::size_t seed_words_;
+	bool pclmul_;
+};
+
+} // namespace geiger
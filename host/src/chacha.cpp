@@ -0,0 +1,179 @@
+/*
+	geiger::ChaCha20 - a ChaCha20 keystream, see include/geiger/chacha.hpp
+
+	Eight blocks are computed at a time, one per lane of a GCC vector of eight 32 bit words, so
+	the same code becomes two SSE2 registers per state word on any x86-64, one AVX2 register
+	where the CPU has it (chosen at run time), or whatever the target offers elsewhere.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/chacha.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEIGER_HAVE_AVX2
+#endif
+
+namespace geiger {
+
+namespace {
+
+constexpr unsigned lanes = 8;
+
+typedef std::uint32_t Words __attribute__((vector_size(4 * lanes)));
+
+#define ROTL(v, n) ((v) << (n) | (v) >> (32 - (n)))
+
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+inline std::uint32_t load_le32(const std::byte *p)
+{
+	std::uint32_t w;
+	std::memcpy(&w, p, sizeof(w));
+	if constexpr (std::endian::native == std::endian::big)
+		w = __builtin_bswap32(w);
+	return w;
+}
+
+// Blocks first_block to first_block + lanes - 1 into out, lanes * 64 bytes
+__attribute__((always_inline)) inline void blocks(const std::uint32_t *state, std::uint64_t first_block,
+	std::byte *out)
+{
+	const Words lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	Words x[16], in[16];
+
+	for (int i = 0; i < 16; i++)
+		in[i] = Words{} + state[i];
+	// Lane j counts block first_block + j, with the carry into the high word
+	in[12] = static_cast<std::uint32_t>(first_block) + lane;
+	in[13] = static_cast<std::uint32_t>(first_block >> 32) - (Words)(in[12] < lane);
+	for (int i = 0; i < 16; i++)
+		x[i] = in[i];
+	for (int round = 0; round < 10; round++) {
+		QUARTER(x[0], x[4], x[8], x[12])
+		QUARTER(x[1], x[5], x[9], x[13])
+		QUARTER(x[2], x[6], x[10], x[14])
+		QUARTER(x[3], x[7], x[11], x[15])
+		QUARTER(x[0], x[5], x[10], x[15])
+		QUARTER(x[1], x[6], x[11], x[12])
+		QUARTER(x[2], x[7], x[8], x[13])
+		QUARTER(x[3], x[4], x[9], x[14])
+	}
+	for (int i = 0; i < 16; i++)
+		x[i] += in[i];
+
+	// Lane j is block j: word i of it goes to byte 64 j + 4 i
+	for (unsigned j = 0; j < lanes; j++) {
+		for (int i = 0; i < 16; i++) {
+			std::uint32_t w = x[i][j];
+			if constexpr (std::endian::native == std::endian::big)
+				w = __builtin_bswap32(w);
+			std::memcpy(out + ChaCha20::block_bytes * j + 4 * i, &w, sizeof(w));
+		}
+	}
+}
+
+void generate_generic(const std::uint32_t *state, std::span<std::byte> out, std::uint64_t block)
+{
+	constexpr std::size_t step = lanes * ChaCha20::block_bytes;
+	std::size_t n = 0;
+
+	for (; n + step <= out.size(); n += step, block += lanes)
+		blocks(state, block, out.data() + n);
+	if (n < out.size()) {
+		std::byte last[step];
+		blocks(state, block, last);
+		std::memcpy(out.data() + n, last, out.size() - n);
+	}
+}
+
+#ifdef GEIGER_HAVE_AVX2
+// The same, with the vectors in AVX2 registers
+__attribute__((target("avx2")))
+void generate_avx2(const std::uint32_t *state, std::span<std::byte> out, std::uint64_t block)
+{
+	constexpr std::size_t step = lanes * ChaCha20::block_bytes;
+	std::size_t n = 0;
+
+	for (; n + step <= out.size(); n += step, block += lanes)
+		blocks(state, block, out.data() + n);
+	if (n < out.size()) {
+		std::byte last[step];
+		blocks(state, block, last);
+		std::memcpy(out.data() + n, last, out.size() - n);
+	}
+}
+#endif
+
+} // namespace
+
+ChaCha20::ChaCha20(std::span<const std::byte, key_bytes> key, std::uint64_t nonce)
+	: avx2_(false)
+{
+	// "expand 32-byte k"
+	state_[0] = 0x61707865;
+	state_[1] = 0x3320646e;
+	state_[2] = 0x79622d32;
+	state_[3] = 0x6b206574;
+	for (int i = 0; i < 8; i++)
+		state_[4 + i] = load_le32(key.data() + 4 * i);
+	state_[12] = state_[13] = 0;		// the block counter, set per block
+	state_[14] = static_cast<std::uint32_t>(nonce);
+	state_[15] = static_cast<std::uint32_t>(nonce >> 32);
+#ifdef GEIGER_HAVE_AVX2
+	avx2_ = __builtin_cpu_supports("avx2");
+#endif
+}
+
+const char *ChaCha20::kernel() const noexcept
+{
+	return avx2_ ? "avx2" : "generic";
+}
+
+void ChaCha20::generate(std::span<std::byte> out, std::uint64_t first_block) const
+{
+#ifdef GEIGER_HAVE_AVX2
+	if (avx2_)
+		return generate_avx2(state_, out, first_block);
+#endif
+	generate_generic(state_, out, first_block);
+}
+
+void bulk_fill(const ChaCha20 &c, std::span<std::byte> out, unsigned threads, std::uint64_t first_block)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// Whole blocks per thread, rounded up to whole pages so threads don't share any
+	const std::size_t blocks = (out.size() + ChaCha20::block_bytes - 1) / ChaCha20::block_bytes;
+	std::size_t per = (blocks + threads - 1) / threads;
+	per = (per + 63) / 64 * 64;
+	if (per >= blocks) {
+		c.generate(out, first_block);
+		return;
+	}
+
+	std::vector<std::jthread> pool;
+	for (std::size_t b = 0; b < blocks; b += per) {
+		std::size_t begin = b * ChaCha20::block_bytes;
+		std::size_t len = std::min(per * ChaCha20::block_bytes, out.size() - begin);
+		pool.emplace_back([&c, part = out.subspan(begin, len), block = first_block + b] {
+			c.generate(part, block);
+		});
+	}
+}
+
+} // namespace geiger
@@ -0,0 +1,90 @@
+/*
+	geiger::HealthTest - SP 800-90B health tests, see include/geiger/health.hpp
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/health.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace geiger {
+
+namespace {
+
+constexpr double alpha_log2 = -20;		// false alarm probability per test
+
+// The smallest k with P(X <= k) >= 1 - alpha for X ~ Binomial(n, p), CRITBINOM in SP 800-90B
+unsigned critbinom(unsigned n, double p)
+{
+	const double target = 1 - std::exp2(alpha_log2);
+	double cdf = 0;
+
+	for (unsigned k = 0; k < n; k++) {
+		cdf += std::exp(std::lgamma(n + 1.0) - std::lgamma(k + 1.0) - std::lgamma(n - k + 1.0) +
+			k * std::log(p) + (n - k) * std::log1p(-p));
+		if (cdf >= target)
+			return k;
+	}
+	return n;
+}
+
+} // namespace
+
+HealthTest::HealthTest(double h)
+{
+	if (!(h > 0 && h <= 1))
+		throw std::invalid_argument("HealthTest: min-entropy per bit must be in (0, 1]");
+	const double per_byte = 8 * h;
+	rct_cutoff_ = 1 + static_cast<unsigned>(std::ceil(-alpha_log2 / per_byte));
+	apt_cutoff_ = 1 + critbinom(apt_window, std::exp2(-per_byte));
+}
+
+HealthTest::Result HealthTest::run(std::span<const std::byte> bytes) noexcept
+{
+	Result first = Result::ok;
+
+	for (std::byte b : bytes) {
+		std::uint8_t v = static_cast<std::uint8_t>(b);
+
+		// A repeat extends the run, anything else starts a new one
+		rct_count_ = v == rct_value_ ? rct_count_ + 1 : 1;
+		rct_value_ = v;
+		if (rct_count_ >= rct_cutoff_) {
+			rct_count_ = apt_seen_ = 0;
+			if (first == Result::ok)
+				first = Result::repetition;
+			continue;
+		}
+
+		// The first byte of a window is the one counted
+		if (apt_seen_ == 0)
+			apt_value_ = v;
+		apt_count_ = apt_seen_ == 0 ? 1 : apt_count_ + (v == apt_value_);
+		if (apt_count_ >= apt_cutoff_) {
+			rct_count_ = apt_seen_ = 0;
+			if (first == Result::ok)
+				first = Result::proportion;
+			continue;
+		}
+		if (++apt_seen_ == apt_window)
+			apt_seen_ = 0;
+	}
+	return first;
+}
+
+const char *HealthTest::name(Result r) noexcept
+{
+	switch (r) {
+	case Result::ok:			return "ok";
+	case Result::repetition:	return "repetition count test";
+	case Result::proportion:	return "adaptive proportion test";
+	}
+	return "?";
+}
+
+} // namespace geiger
@@ -0,0 +1,298 @@
+/*
+	geiger::QualityMonitor - sliding window statistics, see include/geiger/monitor.hpp
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/monitor.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEIGER_HAVE_AVX2
+#endif
+
+namespace geiger {
+
+namespace {
+
+// Bit transitions in a run of bytes read most significant bit first, from the last bit of before.
+// Eight bytes at a time as one big endian word, there is no byte wise popcount instruction.
+inline std::uint64_t transitions(const std::uint8_t *p, std::size_t n, std::uint8_t before)
+{
+	std::uint64_t t = 0;
+	std::size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		std::uint64_t w;
+		std::memcpy(&w, p + i, 8);
+		if constexpr (std::endian::native == std::endian::little)
+			w = __builtin_bswap64(w);
+		t += static_cast<unsigned>(std::popcount((w ^ (w >> 1)) & 0x7fffffffffffffff)) + ((before ^ (w >> 63)) & 1);
+		before = p[i + 7];
+	}
+	for (; i < n; i++) {
+		const unsigned cur = p[i];
+		t += static_cast<unsigned>(std::popcount((cur ^ (cur >> 1)) & 0x7fu)) + ((before ^ (cur >> 7)) & 1);
+		before = p[i];
+	}
+	return t;
+}
+
+// Add the sums of x[i] * x[i - k] over the n bytes of x to pairs[k - 1], for k = 1 to lags, and
+// return the transitions. x[-max_lags] to x[-1] are the bytes before. n is at most 4096, so a
+// sum fits in 32 bits.
+std::uint64_t sum_generic(const std::uint8_t *x, std::size_t n, unsigned lags, std::uint8_t before,
+	std::uint64_t *pairs) noexcept
+{
+	for (unsigned k = 1; k <= lags; k++) {
+		const std::uint8_t *y = x - k;
+		std::uint32_t sum = 0;
+		for (std::size_t i = 0; i < n; i++)
+			sum += static_cast<std::uint32_t>(x[i] * y[i]);
+		pairs[k - 1] += sum;
+	}
+	return transitions(x, n, before);
+}
+
+#ifdef GEIGER_HAVE_AVX2
+// The same, 16 products at a time: the bytes widened to 16 bits, multiplied and added in pairs
+// into 32 bit lanes by vpmaddwd. A lane gets at most 2 * 255^2 per 16 bytes.
+__attribute__((target("avx2,popcnt")))
+std::uint64_t sum_avx2(const std::uint8_t *x, std::size_t n, unsigned lags, std::uint8_t before,
+	std::uint64_t *pairs) noexcept
+{
+	const std::size_t whole = n / 16 * 16;
+
+	for (unsigned k = 1; k <= lags; k++) {
+		const std::uint8_t *y = x - k;
+		__m256i acc = _mm256_setzero_si256();
+		for (std::size_t i = 0; i < whole; i += 16) {
+			const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)));
+			const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(y + i)));
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+		}
+		__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+		std::uint32_t sum = static_cast<std::uint32_t>(_mm_cvtsi128_si32(s));
+		for (std::size_t i = whole; i < n; i++)
+			sum += static_cast<std::uint32_t>(x[i] * y[i]);
+		pairs[k - 1] += sum;
+	}
+	return transitions(x, n, before);
+}
+#endif
+
+} // namespace
+
+QualityMonitor::QualityMonitor(std::size_t window, unsigned lags, QualityLimits limits, unsigned sample)
+	: window_(window), block_size_(window / blocks), lags_(lags), sample_(sample), limits_(limits),
+	  avx2_(false), ring_(blocks + 1)
+{
+	if (window < 1024 || !std::has_single_bit(window))
+		throw std::invalid_argument("QualityMonitor: the window must be a power of two of at least 1 KiB");
+	if (lags < 1 || lags > max_lags)
+		throw std::invalid_argument("QualityMonitor: lags must be 1 to 16");
+	if (sample < 1)
+		throw std::invalid_argument("QualityMonitor: sample must be at least 1");
+#ifdef GEIGER_HAVE_AVX2
+	avx2_ = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+}
+
+const char *QualityMonitor::kernel() const noexcept
+{
+	return avx2_ ? "avx2" : "generic";
+}
+
+// Sum up the next n bytes into the current block, at most what it still needs and stage_bytes
+void QualityMonitor::add(const std::uint8_t *bytes, std::size_t n) noexcept
+{
+	Block &b = ring_[current_];
+	std::uint8_t *x = stage_.data() + max_lags;
+	std::memcpy(x, bytes, n);
+	// Before the first byte there is nothing, and no transition
+	const std::uint8_t before = started_ ? x[-1] : static_cast<std::uint8_t>(x[0] >> 7);
+
+	// The products and the transition that reach back into the block before. At the start of
+	// the stream the bytes before are 0, and so are their products.
+	for (std::size_t o = fill_; o < lags_ && o < fill_ + n; o++) {
+		const std::uint8_t *at = x + (o - fill_);
+		for (unsigned k = static_cast<unsigned>(o) + 1; k <= lags_; k++)
+			b.cross[k - 1] += static_cast<std::uint32_t>(at[0] * *(at - k));
+	}
+	if (fill_ == 0)
+		b.cross_transition = (before ^ (x[0] >> 7)) & 1;
+
+	for (std::size_t i = 0; i < n; i++)
+		++b.hist[x[i]];
+#ifdef GEIGER_HAVE_AVX2
+	if (avx2_)
+		b.transitions += sum_avx2(x, n, lags_, before, b.pairs.data());
+	else
+#endif
+		b.transitions += sum_generic(x, n, lags_, before, b.pairs.data());
+
+	// Keep the last max_lags bytes for the next run
+	std::memmove(stage_.data(), x + n - max_lags, max_lags);
+	started_ = true;
+	if ((fill_ += n) == block_size_)
+		end_block();
+}
+
+// The current block is complete: it replaces the oldest one in the window's sums
+void QualityMonitor::end_block() noexcept
+{
+	const Block &b = ring_[current_];
+
+	if (complete_ == blocks) {
+		const Block &o = oldest();
+		for (unsigned v = 0; v < 256; v++)
+			hist_[v] -= o.hist[v];
+		for (unsigned k = 0; k < lags_; k++)
+			pairs_[k] -= o.pairs[k];
+		transitions_ -= o.transitions;
+	} else {
+		++complete_;
+	}
+	for (unsigned v = 0; v < 256; v++)
+		hist_[v] += b.hist[v];
+	for (unsigned k = 0; k < lags_; k++)
+		pairs_[k] += b.pairs[k];
+	transitions_ += b.transitions;
+
+	current_ = (current_ + 1) % ring_.size();
+	ring_[current_] = Block{};
+	fill_ = 0;
+	skip_ = (sample_ - 1) * block_size_;
+}
+
+// The oldest complete block, the current one if the window has none yet
+const QualityMonitor::Block &QualityMonitor::oldest() const noexcept
+{
+	return ring_[(current_ + ring_.size() - complete_) % ring_.size()];
+}
+
+QualityMonitor::Result QualityMonitor::run(std::span<const std::byte> bytes) noexcept
+{
+	const auto *p = reinterpret_cast<const std::uint8_t *>(bytes.data());
+	std::size_t left = bytes.size();
+
+	while (left > 0) {
+		// The blocks between two sampled ones aren't looked at
+		if (skip_) {
+			std::size_t n = std::min(left, skip_);
+			p += n;
+			left -= n;
+			skip_ -= n;
+			continue;
+		}
+		std::size_t n = std::min({ left, block_size_ - fill_, stage_bytes });
+		add(p, n);
+		p += n;
+		left -= n;
+		if (fill_ == 0 && full())
+			last_ = check();
+	}
+	return last_;
+}
+
+QualityMonitor::Stats QualityMonitor::stats() const noexcept
+{
+	Stats s = {};
+	const std::size_t count = complete_ * block_size_;
+	const double n = static_cast<double>(count);
+
+	s.bytes = count;
+	if (count < 2)
+		return s;
+
+	// Everything but the correlation and the runs follows from the histogram
+	double ones = 0, sum = 0, sum2 = 0, chi = 0;
+	std::array<double, 8> pos_ones = {};
+	const double expect = n / 256;
+	for (unsigned v = 0; v < 256; v++) {
+		const double h = hist_[v];
+		ones += h * std::popcount(v);
+		for (unsigned i = 0; i < 8; i++)
+			pos_ones[i] += (v >> i & 1) * h;
+		sum += h * v;
+		sum2 += h * v * v;
+		chi += (h - expect) * (h - expect) / expect;
+	}
+
+	const double bits = 8 * n;
+	s.frequency = (ones - bits / 2) / std::sqrt(bits / 4);
+	for (unsigned i = 0; i < 8; i++) {
+		double z = (pos_ones[i] - n / 2) / std::sqrt(n / 4);
+		if (std::fabs(z) > std::fabs(s.bit_position)) {
+			s.bit_position = z;
+			s.worst_bit = i;
+		}
+	}
+
+	constexpr double df = 255;
+	s.chi_square = chi;
+	s.chi_square_z = (std::cbrt(chi / df) - (1 - 2 / (9 * df))) / std::sqrt(2 / (9 * df));
+
+	// The window's products and transitions, without those reaching back out of it
+	const Block &o = oldest();
+	const double mean = sum / n, var = sum2 / n - mean * mean;
+	for (unsigned k = 1; k <= lags_ && k < count; k++) {
+		const double pairs = n - k;
+		const double lag_sum = static_cast<double>(pairs_[k - 1] - o.cross[k - 1]);
+		double r = var > 0 ? (lag_sum / pairs - mean * mean) / var : 1;
+		double z = r * std::sqrt(pairs);
+		if (std::fabs(z) > std::fabs(s.correlation)) {
+			s.correlation = z;
+			s.worst_lag = k;
+		}
+	}
+
+	const double n1 = ones, n0 = bits - ones, m = 2 * n1 * n0;
+	const double runs_var = m * (m - bits) / (bits * bits * (bits - 1));
+	const double transitions = static_cast<double>(transitions_ - o.cross_transition);
+	s.runs = runs_var > 0 ? (transitions + 1 - (1 + m / bits)) / std::sqrt(runs_var) : 0;
+	return s;
+}
+
+QualityMonitor::Result QualityMonitor::check() const noexcept
+{
+	const Stats s = stats();
+
+	if (std::fabs(s.frequency) > limits_.frequency)
+		return Result::frequency;
+	if (std::fabs(s.bit_position) > limits_.bit_position)
+		return Result::bit_position;
+	if (std::fabs(s.chi_square_z) > limits_.chi_square)
+		return Result::chi_square;
+	if (std::fabs(s.correlation) > limits_.correlation)
+		return Result::correlation;
+	if (std::fabs(s.runs) > limits_.runs)
+		return Result::runs;
+	return Result::ok;
+}
+
+const char *QualityMonitor::name(Result r) noexcept
+{
+	switch (r) {
+	case Result::ok:			return "ok";
+	case Result::frequency:		return "frequency";
+	case Result::bit_position:	return "bit position";
+	case Result::chi_square:	return "chi-square";
+	case Result::correlation:	return "serial correlation";
+	case Result::runs:			return "runs";
+	}
+	return "?";
+}
+
+} // namespace geiger
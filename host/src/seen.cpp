@@ -0,0 +1,345 @@
+/*
+	geiger::SeenIndex - a persistent index of served chunks, see include/geiger/seen.hpp
+
+	The file is a 4 KiB header followed by 2^k buckets of four 32 bit fingerprints, 0 meaning
+	an empty slot. A chunk's 64 bit SipHash-2-4, keyed with 16 random bytes from the header,
+	picks its first bucket with the low bits and gives its fingerprint with the high 32. The
+	second bucket is the first XOR a hash of the fingerprint, so either can be found from the
+	other when a fingerprint is moved (partial-key cuckoo hashing, Fan et al. 2014), out of a
+	slot picked at random. When 500 moves don't find a free slot, the last fingerprint moved is kept in the header as the
+	victim, and the index is full.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/seen.hpp"
+
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace geiger {
+
+namespace {
+
+constexpr char magic[8] = { 'G', 'E', 'I', 'G', 'E', 'R', 'S', 'I' };
+constexpr std::size_t header_bytes = 4096;
+constexpr unsigned slots_per_bucket = 4;
+constexpr unsigned max_kicks = 500;
+// Load the index is made for. With the slot to evict picked at random, filling an index until
+// an insert failed stopped at 95.5 to 97.5% of the slots, from 2^12 to 2^24 of them; the larger
+// the index, the lower.
+constexpr unsigned load_percent = 93;
+
+[[noreturn]] void fail(const std::string &what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+constexpr std::uint64_t splitmix(std::uint64_t &x)
+{
+	std::uint64_t z = (x += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+// Random but fixed, every program has to cut the same chunks
+constexpr std::array<std::uint64_t, 256> gear = [] {
+	std::array<std::uint64_t, 256> g{};
+	std::uint64_t x = 0x47656967657252ULL;
+	for (auto &v : g)
+		v = splitmix(x);
+	return g;
+}();
+
+std::uint64_t load_le64(const std::byte *p, std::size_t n = 8)
+{
+	std::uint64_t v = 0;
+	for (std::size_t i = 0; i < n; i++)
+		v |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+	return v;
+}
+
+#define SIPROUND \
+	v0 += v1; v1 = std::rotl(v1, 13); v1 ^= v0; v0 = std::rotl(v0, 32); \
+	v2 += v3; v3 = std::rotl(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = std::rotl(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = std::rotl(v1, 17); v1 ^= v2; v2 = std::rotl(v2, 32);
+
+std::uint64_t siphash(const std::uint8_t key[16], std::span<const std::byte> in)
+{
+	const std::uint64_t k0 = load_le64(reinterpret_cast<const std::byte *>(key));
+	const std::uint64_t k1 = load_le64(reinterpret_cast<const std::byte *>(key) + 8);
+	std::uint64_t v0 = k0 ^ 0x736f6d6570736575, v1 = k1 ^ 0x646f72616e646f6d;
+	std::uint64_t v2 = k0 ^ 0x6c7967656e657261, v3 = k1 ^ 0x7465646279746573;
+	const std::size_t whole = in.size() / 8 * 8;
+
+	for (std::size_t i = 0; i < whole; i += 8) {
+		std::uint64_t m = load_le64(in.data() + i);
+		v3 ^= m;
+		SIPROUND SIPROUND
+		v0 ^= m;
+	}
+	std::uint64_t m = load_le64(in.data() + whole, in.size() - whole) |
+		static_cast<std::uint64_t>(in.size()) << 56;
+	v3 ^= m;
+	SIPROUND SIPROUND
+	v0 ^= m;
+	v2 ^= 0xff;
+	SIPROUND SIPROUND SIPROUND SIPROUND
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Where the other bucket of a fingerprint is
+inline std::uint64_t alt_bucket(std::uint64_t bucket, std::uint32_t fp, std::uint64_t mask)
+{
+	return (bucket ^ (fp * 0x5bd1e995ULL)) & mask;
+}
+
+} // namespace
+
+struct SeenIndex::Header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t chunk_log2;
+	std::uint64_t buckets;
+	std::uint64_t count;			// fingerprints stored, including the victim
+	std::uint8_t key[16];
+	std::uint64_t victim_bucket;
+	std::uint32_t victim;			// 0 if none
+};
+
+Chunker::Chunker(unsigned avg_log2)
+	: shift_(64 - avg_log2), min_(std::size_t(1) << avg_log2 >> 2), max_(std::size_t(4) << avg_log2)
+{
+	if (avg_log2 < 6 || avg_log2 > 24)
+		throw std::invalid_argument("Chunker: chunks must be 64 bytes to 16 MiB");
+}
+
+std::size_t Chunker::next(std::span<const std::byte> bytes) noexcept
+{
+	for (std::size_t i = 0; i < bytes.size(); i++) {
+		hash_ = (hash_ << 1) + gear[static_cast<std::uint8_t>(bytes[i])];
+		if (++len_ >= max_ || (len_ >= min_ && (hash_ >> shift_) == 0)) {
+			reset();
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+SeenIndex SeenIndex::open(const std::string &path, std::uint64_t capacity, unsigned chunk_log2)
+{
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	bool fresh = false;
+	if (fd < 0 && errno == ENOENT && capacity > 0) {
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		fresh = true;
+	}
+	if (fd < 0)
+		fail(path);
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		fail(path + " is in use");
+	}
+
+	std::size_t bytes;
+	if (fresh) {
+		// Four slots per bucket, at load_percent at most
+		std::uint64_t buckets = std::bit_ceil((capacity * 100 / load_percent + slots_per_bucket - 1) /
+			slots_per_bucket);
+		bytes = header_bytes + buckets * slots_per_bucket * sizeof(std::uint32_t);
+		if (chunk_log2 < 6 || chunk_log2 > 24 || ftruncate(fd, static_cast<off_t>(bytes)) < 0) {
+			int err = chunk_log2 < 6 || chunk_log2 > 24 ? EINVAL : errno;
+			::close(fd);
+			::unlink(path.c_str());
+			errno = err;
+			fail(path);
+		}
+		Header h = {};
+		std::memcpy(h.magic, magic, sizeof(magic));
+		h.version = 1;
+		h.chunk_log2 = chunk_log2;
+		h.buckets = buckets;
+		if (getrandom(h.key, sizeof(h.key), 0) != sizeof(h.key) ||
+				pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+			int err = errno;
+			::close(fd);
+			::unlink(path.c_str());
+			errno = err;
+			fail(path);
+		}
+	} else {
+		struct stat st;
+		Header h;
+		if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+				std::memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != 1 ||
+				!std::has_single_bit(h.buckets) ||
+				static_cast<std::uint64_t>(st.st_size) != header_bytes + h.buckets * slots_per_bucket * 4) {
+			::close(fd);
+			errno = EINVAL;
+			fail(path + " is not an index");
+		}
+		bytes = static_cast<std::size_t>(st.st_size);
+	}
+
+	void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		fail("mmap " + path);
+	}
+	return SeenIndex(fd, map, bytes);
+}
+
+SeenIndex::SeenIndex(int fd, void *map, std::size_t bytes) noexcept
+	: fd_(fd), map_(map), bytes_(bytes), header_(static_cast<Header *>(map)),
+	  slots_(reinterpret_cast<std::uint32_t *>(static_cast<char *>(map) + header_bytes)),
+	  mask_(header_->buckets - 1), rng_(load_le64(reinterpret_cast<const std::byte *>(header_->key)))
+{
+}
+
+SeenIndex::SeenIndex(SeenIndex &&other) noexcept
+	: fd_(std::exchange(other.fd_, -1)), map_(std::exchange(other.map_, nullptr)),
+	  bytes_(other.bytes_), header_(other.header_), slots_(other.slots_), mask_(other.mask_),
+	  rng_(other.rng_), dirty_(std::exchange(other.dirty_, false))
+{
+}
+
+SeenIndex &SeenIndex::operator=(SeenIndex &&other) noexcept
+{
+	if (this != &other) {
+		close();
+		fd_ = std::exchange(other.fd_, -1);
+		map_ = std::exchange(other.map_, nullptr);
+		bytes_ = other.bytes_;
+		header_ = other.header_;
+		slots_ = other.slots_;
+		mask_ = other.mask_;
+		rng_ = other.rng_;
+		dirty_ = std::exchange(other.dirty_, false);
+	}
+	return *this;
+}
+
+SeenIndex::~SeenIndex()
+{
+	close();
+}
+
+void SeenIndex::close() noexcept
+{
+	if (map_) {
+		msync(map_, bytes_, MS_SYNC);
+		munmap(map_, bytes_);
+	}
+	if (fd_ >= 0)
+		::close(fd_);		// drops the lock
+}
+
+std::uint64_t SeenIndex::hash(std::span<const std::byte> chunk) const noexcept
+{
+	return siphash(header_->key, chunk);
+}
+
+void SeenIndex::sync()
+{
+	// The kernel knows which pages of the mapping were written, and writes just those
+	if (dirty_ && fdatasync(fd_) < 0)
+		fail("fdatasync of the index");
+	dirty_ = false;
+}
+
+std::uint64_t SeenIndex::size() const noexcept
+{
+	return header_->count;
+}
+
+std::uint64_t SeenIndex::capacity() const noexcept
+{
+	return header_->buckets * slots_per_bucket * load_percent / 100;
+}
+
+unsigned SeenIndex::chunk_log2() const noexcept
+{
+	return header_->chunk_log2;
+}
+
+bool SeenIndex::contains(std::span<const std::byte> chunk) const noexcept
+{
+	const std::uint64_t h = hash(chunk);
+	const std::uint32_t fp = static_cast<std::uint32_t>(h >> 32) | 1;
+	const std::uint64_t b1 = h & mask_, b2 = alt_bucket(b1, fp, mask_);
+	const std::uint32_t *s1 = slots_ + b1 * slots_per_bucket, *s2 = slots_ + b2 * slots_per_bucket;
+	bool found = header_->victim == fp && (header_->victim_bucket == b1 || header_->victim_bucket == b2);
+
+	for (unsigned i = 0; i < slots_per_bucket; i++)
+		found |= (s1[i] == fp) | (s2[i] == fp);
+	return found;
+}
+
+bool SeenIndex::insert(std::span<const std::byte> chunk)
+{
+	if (contains(chunk))
+		return false;
+	if (header_->victim)
+		throw std::length_error("index full");
+
+	const std::uint64_t h = hash(chunk);
+	std::uint32_t fp = static_cast<std::uint32_t>(h >> 32) | 1;
+	std::uint64_t bucket = h & mask_;
+	dirty_ = true;
+	for (std::uint64_t b : { bucket, alt_bucket(bucket, fp, mask_) }) {
+		std::uint32_t *s = slots_ + b * slots_per_bucket;
+		for (unsigned i = 0; i < slots_per_bucket; i++) {
+			if (s[i] == 0) {
+				s[i] = fp;
+				++header_->count;
+				return true;
+			}
+		}
+	}
+
+	// Both full: move fingerprints along until one finds a free slot. The slot to evict is
+	// picked at random: picked from the fingerprint, the same ones keep trading places in a
+	// cycle, and the index fills up at about 90% instead.
+	bucket = alt_bucket(bucket, fp, mask_);
+	for (unsigned kick = 0; kick < max_kicks; kick++) {
+		std::uint32_t *s = slots_ + bucket * slots_per_bucket;
+		std::swap(fp, s[splitmix(rng_) % slots_per_bucket]);
+		bucket = alt_bucket(bucket, fp, mask_);
+		s = slots_ + bucket * slots_per_bucket;
+		for (unsigned i = 0; i < slots_per_bucket; i++) {
+			if (s[i] == 0) {
+				s[i] = fp;
+				++header_->count;
+				return true;
+			}
+		}
+	}
+	// Not lost, but the next insert will fail
+	header_->victim = fp;
+	header_->victim_bucket = bucket;
+	++header_->count;
+	return true;
+}
+
+} // namespace geiger
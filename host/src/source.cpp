@@ -0,0 +1,462 @@
+/*
+	geiger::Source - random bytes from a GeigerRNG, see include/geiger/source.hpp
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/source.hpp"
+#include "geiger/shared_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace geiger {
+
+namespace {
+
+[[noreturn]] void fail(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+speed_t baud_constant(unsigned baud)
+{
+	switch (baud) {
+	case 9600:		return B9600;
+	case 19200:		return B19200;
+	case 38400:		return B38400;
+	case 57600:		return B57600;
+	case 115200:	return B115200;
+	}
+	errno = EINVAL;
+	fail("unsupported baud rate");
+}
+
+void wait_readable(int fd)
+{
+	pollfd p = { fd, POLLIN, 0 };
+
+	while (poll(&p, 1, -1) < 0)
+		if (errno != EINTR)
+			fail("poll");
+}
+
+// Send a geigerd request
+void send_request(int fd, std::uint32_t req)
+{
+	std::uint8_t hdr[4] = {
+		static_cast<std::uint8_t>(req), static_cast<std::uint8_t>(req >> 8),
+		static_cast<std::uint8_t>(req >> 16), static_cast<std::uint8_t>(req >> 24)
+	};
+	while (::send(fd, hdr, sizeof(hdr), MSG_NOSIGNAL) < 0)
+		if (errno != EINTR)
+			fail("send");
+}
+
+std::uint32_t get_le32(const std::uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+}
+
+// Receive exactly n bytes, or throw
+void recv_all(int fd, void *buf, std::size_t n)
+{
+	auto *p = static_cast<char *>(buf);
+
+	while (n > 0) {
+		ssize_t got = recv(fd, p, n, MSG_WAITALL);
+		if (got == 0) {
+			errno = ECONNRESET;
+			fail("geigerd closed the connection");
+		}
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("recv");
+		}
+		p += got;
+		n -= static_cast<std::size_t>(got);
+	}
+}
+
+int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+} // namespace
+
+Source Source::open_serial(const std::string &path, unsigned baud)
+{
+	speed_t speed = baud_constant(baud);
+	int fd = ::open(path.c_str(), O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		fail(path.c_str());
+
+	termios tio;
+	if (tcgetattr(fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tio.c_cflag |= CLOCAL | CREAD;
+		if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+			int err = errno;
+			::close(fd);
+			errno = err;
+			fail("tcsetattr");
+		}
+	}
+	// Not a tty (eg. a FIFO or a capture file): read it as it is
+	return Source(fd, Kind::serial);
+}
+
+std::string default_socket()
+{
+	const char *dir = std::getenv("XDG_RUNTIME_DIR");
+	if (geteuid() != 0 && dir && *dir)
+		return std::string(dir) + "/geigerd.sock";
+	return "/run/geigerd/geigerd.sock";
+}
+
+Source Source::connect(const std::string &socket_path, uid_t server_uid)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		fail(socket_path.c_str());
+	}
+	std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		fail("socket");
+	if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		fail(socket_path.c_str());
+	}
+	// Whoever bound the path first is at the other end, make sure it is the geigerd we trust
+	ucred cred;
+	socklen_t len = sizeof(cred);
+	if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		fail("SO_PEERCRED");
+	}
+	if (server_uid == root_or_self ? cred.uid != 0 && cred.uid != ::geteuid() : cred.uid != server_uid) {
+		::close(fd);
+		errno = EPERM;
+		fail("geigerd runs as an unexpected user");
+	}
+	return Source(fd, Kind::service);
+}
+
+Source Source::connect_shared(const std::string &socket_path, std::size_t ring_bytes, uid_t server_uid)
+{
+	Source src = connect(socket_path, server_uid);
+	ring_bytes = std::clamp(ring_bytes, min_shared_ring, max_shared_ring);
+	send_request(src.fd_, static_cast<std::uint32_t>(ring_bytes) | request_shared << request_wait_shift);
+
+	// The answer comes with the memfd and the two eventfds
+	std::uint8_t hdr[4];
+	iovec iov = { hdr, sizeof(hdr) };
+	alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))];
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t got;
+	while ((got = ::recvmsg(src.fd_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0)
+		if (errno != EINTR)
+			fail("recvmsg");
+	cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	int fds[3];
+	std::size_t nfds = 0;
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+		nfds = std::min<std::size_t>((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int), 3);
+		std::memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+	}
+	if (got != sizeof(hdr) || nfds != 3) {
+		for (std::size_t i = 0; i < nfds; i++)
+			::close(fds[i]);
+		errno = EPROTO;
+		fail("geigerd refused a shared ring");
+	}
+	src.data_fd_ = fds[1];
+	src.space_fd_ = fds[2];
+
+	std::size_t size = get_le32(hdr);
+	void *map = MAP_FAILED;
+	if (size >= min_shared_ring && size <= max_shared_ring && (size & (size - 1)) == 0)
+		map = ::mmap(nullptr, shared_ring_offset + size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	int err = errno;
+	::close(fds[0]);
+	if (map == MAP_FAILED) {
+		errno = err;
+		fail("mmap of the shared ring");
+	}
+	src.ring_ = static_cast<SharedRing *>(map);
+	src.ring_size_ = size;
+	src.kind_ = Kind::shared;
+	return src;
+}
+
+Source::Source(Source &&other) noexcept
+	: fd_(std::exchange(other.fd_, -1)), kind_(other.kind_),
+	  ring_(std::exchange(other.ring_, nullptr)), ring_size_(other.ring_size_),
+	  data_fd_(std::exchange(other.data_fd_, -1)), space_fd_(std::exchange(other.space_fd_, -1)),
+	  text_(other.text_), text_pos_(other.text_pos_), text_len_(other.text_len_),
+	  nibble_(other.nibble_), comment_(other.comment_), status_(std::move(other.status_)),
+	  line_start_(other.line_start_), line_len_(other.line_len_), line_(other.line_)
+{
+}
+
+Source &Source::operator=(Source &&other) noexcept
+{
+	if (this != &other) {
+		release();
+		fd_ = std::exchange(other.fd_, -1);
+		kind_ = other.kind_;
+		ring_ = std::exchange(other.ring_, nullptr);
+		ring_size_ = other.ring_size_;
+		data_fd_ = std::exchange(other.data_fd_, -1);
+		space_fd_ = std::exchange(other.space_fd_, -1);
+		text_ = other.text_;
+		text_pos_ = other.text_pos_;
+		text_len_ = other.text_len_;
+		nibble_ = other.nibble_;
+		comment_ = other.comment_;
+		status_ = std::move(other.status_);
+		line_start_ = other.line_start_;
+		line_len_ = other.line_len_;
+		line_ = other.line_;
+	}
+	return *this;
+}
+
+Source::~Source()
+{
+	release();
+}
+
+void Source::release() noexcept
+{
+	if (ring_)
+		::munmap(ring_, shared_ring_offset + ring_size_);
+	for (int fd : { fd_, data_fd_, space_fd_ })
+		if (fd >= 0)
+			::close(fd);
+}
+
+std::size_t Source::fill(std::span<std::byte> out, Wait wait)
+{
+	if (out.empty())
+		return 0;
+	if (kind_ == Kind::serial)
+		return fill_serial(out, wait);
+	if (kind_ == Kind::shared)
+		return fill_shared(out, wait);
+	return fill_service(out, wait);
+}
+
+// Decode buffered hex text into out, as far as either goes. Returns the number of bytes.
+std::size_t Source::decode(std::span<std::byte> out)
+{
+	std::size_t n = 0;
+
+	while (text_pos_ < text_len_ && n < out.size()) {
+		char c = text_[text_pos_++];
+		if (comment_) {
+			if (c == '\n') {
+				comment_ = false;
+				if (status_)
+					status_line();
+			}
+			continue;
+		}
+		int v = hex_value(c);
+		if (v >= 0) {
+			if (nibble_ < 0) {
+				nibble_ = static_cast<std::int8_t>(v);
+			} else {
+				out[n++] = static_cast<std::byte>(nibble_ << 4 | v);
+				nibble_ = -1;
+			}
+		} else {
+			// A byte never spans the end of a line, a lone digit there was garbled
+			nibble_ = -1;
+			comment_ = c == '#';
+			line_start_ = static_cast<std::uint16_t>(text_pos_ - 1);
+			line_len_ = 0;
+		}
+	}
+	return n;
+}
+
+// Pass the status line that just ended (text_pos_ is past its '\n') to the handler
+void Source::status_line()
+{
+	const std::size_t end = text_pos_ - 1u;
+	std::string_view line;
+
+	if (line_len_ == 0) {
+		line = std::string_view(text_.data() + line_start_, end - line_start_);
+	} else {
+		std::size_t add = std::min(end, line_.size() - line_len_);
+		std::memcpy(line_.data() + line_len_, text_.data(), add);
+		line = std::string_view(line_.data(), line_len_ + add);
+		line_len_ = 0;
+	}
+	if (!line.empty() && line.back() == '\r')
+		line.remove_suffix(1);
+	if (line.size() > max_status)
+		line = line.substr(0, max_status);
+	status_(line);
+}
+
+// Keep the part of a status line that is in text_ before text_ is read over
+void Source::carry_status() noexcept
+{
+	if (!comment_ || !status_)
+		return;
+	std::size_t from = line_len_ ? 0 : line_start_;
+	std::size_t add = std::min<std::size_t>(text_len_ - from, line_.size() - line_len_);
+	std::memcpy(line_.data() + line_len_, text_.data() + from, add);
+	line_len_ = static_cast<std::uint16_t>(line_len_ + add);
+	text_pos_ = text_len_ = 0;	// so a read that finds nothing doesn't carry it again
+}
+
+std::size_t Source::fill_serial(std::span<std::byte> out, Wait wait)
+{
+	std::size_t n = decode(out);
+
+	while (n < out.size()) {
+		carry_status();
+		ssize_t got = ::read(fd_, text_.data(), text_.size());
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				fail("read");
+			if (wait == Wait::none || (wait == Wait::some && n > 0))
+				break;
+			wait_readable(fd_);
+			continue;
+		}
+		if (got == 0) {
+			// End of a capture file. A tty doesn't get here with O_NONBLOCK.
+			if (wait == Wait::none || n > 0)
+				break;
+			errno = ENODATA;
+			fail("end of input");
+		}
+		text_pos_ = 0;
+		text_len_ = static_cast<std::uint16_t>(got);
+		n += decode(out.subspan(n));
+	}
+	return n;
+}
+
+std::size_t Source::fill_service(std::span<std::byte> out, Wait wait)
+{
+	std::size_t n = 0;
+
+	while (n < out.size()) {
+		std::size_t want = out.size() - n;
+		if (want > max_request)
+			want = max_request;
+		send_request(fd_, static_cast<std::uint32_t>(want) |
+			static_cast<std::uint32_t>(wait) << request_wait_shift);
+
+		std::uint8_t hdr[4];
+		recv_all(fd_, hdr, sizeof(hdr));
+		std::uint32_t count = get_le32(hdr);
+		if (count > want) {
+			errno = EPROTO;
+			fail("geigerd sent more than was asked for");
+		}
+		recv_all(fd_, out.data() + n, count);	// straight into the caller's buffer
+		n += count;
+		if (wait != Wait::all)
+			break;
+	}
+	return n;
+}
+
+// The flags and the eventfds are explained in include/geiger/shared_ring.hpp
+std::size_t Source::fill_shared(std::span<std::byte> out, Wait wait)
+{
+	const std::byte *data = reinterpret_cast<const std::byte *>(ring_) + shared_ring_offset;
+	std::uint64_t tail = ring_->tail.load(std::memory_order_relaxed);
+	std::size_t n = 0;
+
+	for (;;) {
+		std::uint64_t head = ring_->head.load(std::memory_order_acquire);
+		if (head - tail > ring_size_) {
+			errno = EPROTO;
+			fail("shared ring corrupted");
+		}
+		std::size_t take = std::min<std::size_t>(head - tail, out.size() - n);
+		if (take > 0) {
+			std::size_t at = tail & (ring_size_ - 1);
+			std::size_t first = std::min(take, ring_size_ - at);
+			std::memcpy(out.data() + n, data + at, first);
+			std::memcpy(out.data() + n + first, data, take - first);
+			tail += take;
+			n += take;
+			ring_->tail.store(tail);
+			// Wake geigerd if it waits for space, once half the ring is free
+			if (head - tail <= ring_size_ / 2 && ring_->writer_waiting.load() &&
+					ring_->writer_waiting.exchange(0))
+				eventfd_write(space_fd_, 1);
+		}
+		if (n == out.size() || wait == Wait::none || (wait == Wait::some && n > 0))
+			return n;
+
+		// Empty. Say so, look again in case geigerd wrote in between, then sleep.
+		ring_->reader_waiting.store(1);
+		if (ring_->head.load() != head)
+			continue;
+		pollfd p[2] = { { data_fd_, POLLIN, 0 }, { fd_, POLLIN, 0 } };
+		if (::poll(p, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("poll");
+		}
+		if (p[1].revents) {
+			// geigerd never writes to the socket after the handshake, this is the end
+			errno = ECONNRESET;
+			fail("geigerd closed the connection");
+		}
+		eventfd_t v;
+		eventfd_read(data_fd_, &v);		// non-blocking, only resets the count
+	}
+}
+
+} // namespace geiger
@@ -0,0 +1,196 @@
+/*
+	geiger::Toeplitz - a seeded Toeplitz hash extractor, see include/geiger/toeplitz.hpp
+
+	With s the seed and x the block, both as polynomials over GF(2) with bit i the coefficient
+	of z^i, output bit i is T[i][j] x[j] summed over j, with T[i][j] = s[i - j + n - 1]. That is
+	coefficient i + n - 1 of s x, so the output is bits n - 1 to n + m - 2 of the carry-less
+	product. Only the 64 bit words of the product in that range are computed: a block of
+	n = 4096 bits and m = 3904 takes 64 x 62 64 bit multiplies.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/toeplitz.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEIGER_HAVE_PCLMUL
+#endif
+
+namespace geiger {
+
+namespace {
+
+struct Shape {
+	std::size_t seed_words;	// words of the seed
+	std::size_t in_words;	// words of a block
+	std::size_t first;		// first word of the product that holds output bits
+	std::size_t words;		// words of the product needed, from first
+};
+
+// Load a block of bytes as little endian 64 bit words
+inline void load_words(const std::byte *p, std::size_t words, std::uint64_t *out)
+{
+	for (std::size_t i = 0; i < words; i++) {
+		std::uint64_t w = 0;
+		for (int b = 7; b >= 0; b--)
+			w = w << 8 | static_cast<std::uint8_t>(p[8 * i + b]);
+		out[i] = w;
+	}
+}
+
+// Take m bits from bit n - 1 of the product, whose words from shape.first are in r
+inline void store_output(const std::uint64_t *r, std::size_t m, std::byte *out)
+{
+	// n is a multiple of 64, so output bit 0 is bit 63 of word first
+	for (std::size_t i = 0; i < m / 8; i++) {
+		std::size_t bit = 63 + 8 * i;
+		std::uint64_t w = r[bit / 64] >> (bit % 64);
+		if (bit % 64 > 56)
+			w |= r[bit / 64 + 1] << (64 - bit % 64);
+		out[i] = static_cast<std::byte>(w);
+	}
+}
+
+// 64 x 64 bit carry-less multiply, without hardware help
+inline void clmul_portable(std::uint64_t a, std::uint64_t b, std::uint64_t &lo, std::uint64_t &hi)
+{
+	unsigned __int128 r = 0;
+	unsigned __int128 aa = a;
+
+	for (int i = 0; i < 64; i++)
+		r ^= (aa << i) & -static_cast<unsigned __int128>((b >> i) & 1);
+	lo = static_cast<std::uint64_t>(r);
+	hi = static_cast<std::uint64_t>(r >> 64);
+}
+
+void block_portable(const Shape &sh, const std::uint64_t *s, const std::uint64_t *x, std::uint64_t *r)
+{
+	std::memset(r, 0, (sh.words + 1) * sizeof(*r));
+	for (std::size_t j = 0; j < sh.in_words; j++) {
+		// s[i] x[j] lands in words i + j and i + j + 1, keep those that overlap the output
+		std::size_t lo_i = sh.first > j + 1 ? sh.first - j - 1 : 0;
+		std::size_t hi_i = std::min(sh.seed_words, sh.first + sh.words - j);
+		for (std::size_t i = lo_i; i < hi_i; i++) {
+			std::uint64_t lo, hi;
+			clmul_portable(s[i], x[j], lo, hi);
+			std::size_t k = i + j;
+			if (k >= sh.first)
+				r[k - sh.first] ^= lo;
+			r[k + 1 - sh.first] ^= hi;
+		}
+	}
+}
+
+#ifdef GEIGER_HAVE_PCLMUL
+// Product word k is the sum of s[k - j] x[j] over all j, plus the high half of the sum for word
+// k - 1. Here every word is summed in registers, two j at a time from 128 bit loads of seed and
+// block, into four independent accumulators so the multiplies can overlap. s has to be zero
+// padded so that it can be read from s[-in_words - 2] to s[first + words + 1], and x padded
+// to an even number of words.
+__attribute__((target("pclmul,sse4.1")))
+void block_pclmul(const Shape &sh, const std::uint64_t *s, const std::uint64_t *x, std::uint64_t *r)
+{
+	const std::ptrdiff_t pairs = static_cast<std::ptrdiff_t>((sh.in_words + 1) / 2);
+	const std::ptrdiff_t end = static_cast<std::ptrdiff_t>(sh.first + sh.words);
+	std::uint64_t carry = 0;
+
+	for (std::ptrdiff_t k = sh.first ? sh.first - 1 : 0; k < end; k++) {
+		__m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+		std::ptrdiff_t p = 0;
+		for (; p + 1 < pairs; p += 2) {
+			// low qword s[k - j - 1], high s[k - j]; low x[j], high x[j + 1]
+			__m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + k - 2 * p - 1));
+			__m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + 2 * p));
+			__m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + k - 2 * p - 3));
+			__m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + 2 * p + 2));
+			a0 = _mm_xor_si128(a0, _mm_clmulepi64_si128(s0, x0, 0x01));
+			a1 = _mm_xor_si128(a1, _mm_clmulepi64_si128(s0, x0, 0x10));
+			a2 = _mm_xor_si128(a2, _mm_clmulepi64_si128(s1, x1, 0x01));
+			a3 = _mm_xor_si128(a3, _mm_clmulepi64_si128(s1, x1, 0x10));
+		}
+		if (p < pairs) {
+			__m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + k - 2 * p - 1));
+			__m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + 2 * p));
+			a0 = _mm_xor_si128(a0, _mm_clmulepi64_si128(s0, x0, 0x01));
+			a1 = _mm_xor_si128(a1, _mm_clmulepi64_si128(s0, x0, 0x10));
+		}
+		__m128i sum = _mm_xor_si128(_mm_xor_si128(a0, a1), _mm_xor_si128(a2, a3));
+		std::uint64_t lo = static_cast<std::uint64_t>(_mm_cvtsi128_si64(sum));
+		if (k >= static_cast<std::ptrdiff_t>(sh.first))
+			r[k - sh.first] = lo ^ carry;
+		carry = static_cast<std::uint64_t>(_mm_extract_epi64(sum, 1));
+	}
+	r[sh.words] = carry;
+}
+#endif
+
+} // namespace
+
+std::size_t Toeplitz::output_bits(std::size_t n, double h, unsigned security)
+{
+	double m = std::floor(static_cast<double>(n) * h) - 2.0 * security;
+	if (m < 8)
+		return 0;
+	return static_cast<std::size_t>(m) / 8 * 8;
+}
+
+Toeplitz::Toeplitz(std::size_t n, std::size_t m, std::span<const std::byte> seed)
+	: n_(n), m_(m), pclmul_(false)
+{
+	if (n == 0 || n % 64 || m == 0 || m % 8)
+		throw std::invalid_argument("Toeplitz: n must be a multiple of 64 and m of 8");
+	if (seed.size() < seed_bytes(n, m))
+		throw std::invalid_argument("Toeplitz: seed too short");
+
+	// The seed words go after pad_ zero words, and are followed by four more (block_pclmul())
+	std::size_t bits = n + m - 1;
+	pad_ = n / 64 + 2;
+	seed_words_ = (bits + 63) / 64;
+	seed_.assign(pad_ + seed_words_ + 4, 0);
+	for (std::size_t i = 0; i < bits; i++)
+		if (static_cast<std::uint8_t>(seed[i / 8]) >> (i % 8) & 1)
+			seed_[pad_ + i / 64] |= std::uint64_t(1) << (i % 64);
+#ifdef GEIGER_HAVE_PCLMUL
+	pclmul_ = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+const char *Toeplitz::kernel() const noexcept
+{
+	return pclmul_ ? "pclmul" : "portable";
+}
+
+std::size_t Toeplitz::extract(std::span<const std::byte> in, std::span<std::byte> out) const
+{
+	const std::size_t blocks = std::min(in.size() / input_bytes(), out.size() / output_bytes());
+	Shape sh;
+	sh.seed_words = seed_words_;
+	sh.in_words = n_ / 64;
+	sh.first = (n_ - 1) / 64;
+	sh.words = (63 + m_ + 63) / 64;		// output bits start at bit 63 of word first
+	std::vector<std::uint64_t> x(sh.in_words + 1), r(sh.words + 1);
+	const std::uint64_t *s = seed_.data() + pad_;
+
+	for (std::size_t b = 0; b < blocks; b++) {
+		load_words(in.data() + b * input_bytes(), sh.in_words, x.data());
+#ifdef GEIGER_HAVE_PCLMUL
+		if (pclmul_)
+			block_pclmul(sh, s, x.data(), r.data());
+		else
+#endif
+			block_portable(sh, s, x.data(), r.data());
+		store_output(r.data(), m_, out.data() + b * output_bytes());
+	}
+	return blocks;
+}
+
+} // namespace geiger
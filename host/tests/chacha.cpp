@@ -0,0 +1,63 @@
+/*
+	tests/chacha - geiger::ChaCha20 against the block function test vector of RFC 7539,
+	section 2.3.2, and bulk_fill() against generate()
+
+	The RFC's 96 bit nonce 00:00:00:09:00:00:00:4a:00:00:00:00 with block counter 1 is, in
+	the original layout, the 64 bit counter 0x0900000000000001 and the nonce 0x4a000000.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/chacha.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+int main()
+{
+	static const std::uint8_t expect[64] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+	};
+	std::array<std::byte, geiger::ChaCha20::key_bytes> key;
+	for (std::size_t i = 0; i < key.size(); i++)
+		key[i] = static_cast<std::byte>(i);
+	int bad = 0;
+
+	geiger::ChaCha20 c(key, 0x4a000000);
+	std::array<std::byte, 64> block;
+	c.generate(block, 0x0900000000000001);
+	if (std::memcmp(block.data(), expect, sizeof(expect)) != 0) {
+		std::printf("chacha: the RFC 7539 block differs\n");
+		++bad;
+	}
+
+	// Any split of the keystream gives the same bytes, with any number of threads
+	std::vector<std::byte> whole(64 * 1000 + 17), part(whole.size());
+	c.generate(whole, 5);
+	for (unsigned threads : { 1u, 3u, 8u }) {
+		std::fill(part.begin(), part.end(), std::byte{0});
+		geiger::bulk_fill(c, part, threads, 5);
+		if (part != whole) {
+			std::printf("chacha: bulk_fill with %u threads differs\n", threads);
+			++bad;
+		}
+	}
+	c.generate(std::span(part).subspan(64 * 7, 100), 12);
+	if (std::memcmp(part.data() + 64 * 7, whole.data() + 64 * 7, 100) != 0) {
+		std::printf("chacha: a range from block 12 differs\n");
+		++bad;
+	}
+
+	std::printf("chacha: %s (%s)\n", bad ? "FAIL" : "ok", c.kernel());
+	return bad != 0;
+}
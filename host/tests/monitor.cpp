@@ -0,0 +1,127 @@
+/*
+	tests/monitor - geiger::QualityMonitor against the statistics worked out from scratch
+
+	Feeds random streams, some of them biased, in pieces of random size and compares stats()
+	with the same tests computed directly over the bytes the window should hold: the last
+	16 complete blocks, or with a sample over 1, the last 16 of the blocks 0, sample,
+	2 sample, ... joined together.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/monitor.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+geiger::QualityMonitor::Stats direct(const std::uint8_t *x, std::size_t count, unsigned lags)
+{
+	geiger::QualityMonitor::Stats s = {};
+	const double n = static_cast<double>(count);
+	double h[256] = {};
+	double ones = 0, sum = 0, sum2 = 0, chi = 0;
+
+	s.bytes = count;
+	for (std::size_t i = 0; i < count; i++)
+		h[x[i]]++;
+	for (unsigned v = 0; v < 256; v++) {
+		ones += h[v] * std::popcount(v);
+		sum += h[v] * v;
+		sum2 += h[v] * v * v;
+		chi += (h[v] - n / 256) * (h[v] - n / 256) / (n / 256);
+	}
+	const double bits = 8 * n;
+	s.frequency = (ones - bits / 2) / std::sqrt(bits / 4);
+	s.chi_square = chi;
+
+	const double mean = sum / n, var = sum2 / n - mean * mean;
+	for (unsigned k = 1; k <= lags; k++) {
+		double lag_sum = 0;
+		for (std::size_t i = k; i < count; i++)
+			lag_sum += x[i] * x[i - k];
+		const double pairs = n - k;
+		const double z = (lag_sum / pairs - mean * mean) / var * std::sqrt(pairs);
+		if (std::fabs(z) > std::fabs(s.correlation))
+			s.correlation = z;
+	}
+
+	double transitions = 0;
+	for (std::size_t i = 0; i < count; i++) {
+		for (int b = 7; b > 0; b--)
+			transitions += ((x[i] >> b) ^ (x[i] >> (b - 1))) & 1;
+		if (i)
+			transitions += (x[i - 1] ^ (x[i] >> 7)) & 1;
+	}
+	const double n1 = ones, n0 = bits - ones, m = 2 * n1 * n0;
+	const double runs_var = m * (m - bits) / (bits * bits * (bits - 1));
+	s.runs = (transitions + 1 - (1 + m / bits)) / std::sqrt(runs_var);
+	return s;
+}
+
+inline bool near(double a, double b)
+{
+	return std::fabs(a - b) < 1e-6 * (1 + std::fabs(b));
+}
+
+} // namespace
+
+int main()
+{
+	std::mt19937_64 rng(7);
+	int bad = 0;
+
+	for (int trial = 0; trial < 48; trial++) {
+		const std::size_t window = std::size_t{1024} << (trial % 3);
+		const unsigned lags = 1 + trial % geiger::QualityMonitor::max_lags;
+		const unsigned sample = trial < 32 ? 1 : 2 + trial % 3;
+		const std::size_t block = window / geiger::QualityMonitor::blocks;
+		geiger::QualityMonitor m(window, lags, {}, sample);
+
+		// Random pieces, short ones or long ones, of bytes with a bias in every fifth trial
+		std::vector<std::uint8_t> all;
+		const std::size_t total = sample * (window * 3 + rng() % (window * 2));
+		while (all.size() < total) {
+			std::vector<std::byte> piece(1 + rng() % (trial % 2 ? 700 : 37));
+			for (auto &b : piece) {
+				std::uint8_t v = static_cast<std::uint8_t>(rng());
+				if (trial % 5 == 0 && (rng() & 3) == 0)
+					v |= 0x81;
+				b = static_cast<std::byte>(v);
+				all.push_back(v);
+			}
+			m.run(piece);
+		}
+
+		std::vector<std::uint8_t> sampled;
+		for (std::size_t b = 0; (b + 1) * block <= all.size(); b += sample)
+			sampled.insert(sampled.end(), all.begin() + b * block, all.begin() + (b + 1) * block);
+		const std::size_t count = std::min(sampled.size(), window);
+		const auto got = m.stats();
+		if (got.bytes != count) {
+			std::printf("monitor: trial %d: %zu bytes in the window, not %zu\n", trial, got.bytes, count);
+			++bad;
+			continue;
+		}
+		const auto want = direct(sampled.data() + sampled.size() - count, count, lags);
+		if (!near(got.frequency, want.frequency) || !near(got.chi_square, want.chi_square) ||
+				!near(got.correlation, want.correlation) || !near(got.runs, want.runs)) {
+			std::printf("monitor: trial %d: frequency %f/%f chi-square %f/%f correlation %f/%f runs %f/%f\n",
+				trial, got.frequency, want.frequency, got.chi_square, want.chi_square,
+				got.correlation, want.correlation, got.runs, want.runs);
+			++bad;
+		}
+	}
+
+	std::printf("monitor: %s (%s)\n", bad ? "FAIL" : "ok", geiger::QualityMonitor().kernel());
+	return bad != 0;
+}
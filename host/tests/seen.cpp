@@ -0,0 +1,102 @@
+/*
+	tests/seen - geiger::SeenIndex: what was inserted is found, inserting it again is refused,
+	few chunks that weren't inserted are reported as seen, and the index takes at least its
+	capacity() before it is full, for a few sizes
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/seen.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+namespace {
+
+// A distinct chunk for every i
+struct Chunk {
+	std::byte bytes[8];
+
+	explicit Chunk(std::uint64_t i)
+	{
+		for (int k = 0; k < 8; k++)
+			bytes[k] = static_cast<std::byte>(i >> (8 * k));
+	}
+};
+
+} // namespace
+
+int main()
+{
+	char path[] = "/tmp/geiger-seen-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		std::perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	int bad = 0;
+
+	for (unsigned log2 : { 10u, 14u, 18u }) {
+		unlink(path);
+		auto index = geiger::SeenIndex::open(path, (std::uint64_t{1} << log2) * 9 / 10);
+		const std::uint64_t capacity = index.capacity();
+
+		std::uint64_t n = 0;
+		try {
+			for (;; n++)
+				if (!index.insert(Chunk(n).bytes)) {
+					std::printf("seen: 2^%u: chunk %llu refused\n", log2, static_cast<unsigned long long>(n));
+					++bad;
+				}
+		} catch (const std::length_error &) {
+		}
+		index.sync();
+		if (index.size() < capacity) {
+			std::printf("seen: 2^%u: full at %llu of %llu chunks\n", log2,
+				static_cast<unsigned long long>(index.size()), static_cast<unsigned long long>(capacity));
+			++bad;
+		}
+
+		// Everything that went in is there, and is refused a second time
+		for (std::uint64_t i = 0; i < n; i++)
+			if (!index.contains(Chunk(i).bytes)) {
+				std::printf("seen: 2^%u: chunk %llu lost\n", log2, static_cast<unsigned long long>(i));
+				++bad;
+				break;
+			}
+		if (index.insert(Chunk(0).bytes)) {
+			std::printf("seen: 2^%u: chunk 0 inserted twice\n", log2);
+			++bad;
+		}
+
+		// About one in 2^28 of the others is a false positive, none in a million
+		std::uint64_t false_positives = 0;
+		for (std::uint64_t i = 0; i < 1000000; i++)
+			false_positives += index.contains(Chunk(i + (std::uint64_t{1} << 40)).bytes);
+		if (false_positives > 1) {
+			std::printf("seen: 2^%u: %llu false positives in a million\n", log2,
+				static_cast<unsigned long long>(false_positives));
+			++bad;
+		}
+	}
+
+	// What was synced is there after opening it again
+	auto index = geiger::SeenIndex::open(path);
+	if (!index.contains(Chunk(1).bytes)) {
+		std::printf("seen: chunk 1 lost after reopening\n");
+		++bad;
+	}
+	unlink(path);
+
+	std::printf("seen: %s\n", bad ? "FAIL" : "ok");
+	return bad != 0;
+}
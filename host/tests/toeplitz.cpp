@@ -0,0 +1,73 @@
+/*
+	tests/toeplitz - geiger::Toeplitz against the matrix product done one bit at a time,
+	y[i] = sum over j of s[i - j + n - 1] x[j], for a few shapes and random seeds and blocks
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/toeplitz.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Bit i of bytes, LSB first
+inline unsigned bit(const std::vector<std::byte> &bytes, std::size_t i)
+{
+	return static_cast<unsigned>(bytes[i / 8] >> (i % 8)) & 1;
+}
+
+} // namespace
+
+int main()
+{
+	struct Shape { std::size_t n, m; };
+	static const Shape shapes[] = { { 64, 8 }, { 64, 64 }, { 128, 56 }, { 512, 256 }, { 4096, 3904 } };
+	std::mt19937_64 rng(1);
+	int bad = 0;
+	const char *kernel = "";
+
+	for (const Shape &sh : shapes) {
+		std::vector<std::byte> seed(geiger::Toeplitz::seed_bytes(sh.n, sh.m));
+		for (auto &b : seed)
+			b = static_cast<std::byte>(rng());
+		geiger::Toeplitz t(sh.n, sh.m, seed);
+		kernel = t.kernel();
+
+		// Three blocks and a partial one, which is left alone
+		const std::size_t blocks = 3;
+		std::vector<std::byte> in(blocks * t.input_bytes() + 5), out(blocks * t.output_bytes());
+		for (auto &b : in)
+			b = static_cast<std::byte>(rng());
+		if (t.extract(in, out) != blocks) {
+			std::printf("toeplitz: %zu x %zu: wrong number of blocks\n", sh.m, sh.n);
+			++bad;
+			continue;
+		}
+
+		for (std::size_t k = 0; k < blocks; k++) {
+			std::vector<std::byte> x(in.begin() + k * t.input_bytes(), in.begin() + (k + 1) * t.input_bytes());
+			std::vector<std::byte> y(t.output_bytes());
+			for (std::size_t i = 0; i < sh.m; i++) {
+				unsigned sum = 0;
+				for (std::size_t j = 0; j < sh.n; j++)
+					sum ^= bit(seed, i - j + sh.n - 1) & bit(x, j);
+				y[i / 8] |= static_cast<std::byte>(sum << (i % 8));
+			}
+			if (!std::equal(y.begin(), y.end(), out.begin() + k * t.output_bytes())) {
+				std::printf("toeplitz: %zu x %zu: block %zu differs\n", sh.m, sh.n, k);
+				++bad;
+			}
+		}
+	}
+
+	std::printf("toeplitz: %s (%s)\n", bad ? "FAIL" : "ok", kernel);
+	return bad != 0;
+}
@@ -0,0 +1,122 @@
+/*
+	geiger-dedup - pass random bytes through only if they haven't been handed out before
+
+	Reads bytes on stdin, cuts them into content defined chunks and looks each one up in a
+	persistent index (include/geiger/seen.hpp). Chunks not in the index are added to it and
+	written to stdout, chunks that are already there are dropped. Run every capture or reserve
+	file through the same index before use and no chunk of it is used twice, even if a file is
+	imported again or a copy of it starts at a different offset.
+
+	Usage: geiger-dedup [-c] [-C chunks] [-a avg_log2] index < in.bin > out.bin
+
+	If index doesn't exist it is made for at least -C chunks (default 2^24, about 64 GB at the
+	default 4 KiB chunks) of about 2^avg_log2 bytes. With -c nothing is added or written, the
+	exit status is 1 if any chunk was seen before. The end of the input ends the last chunk.
+	The fresh chunks of every 64 KiB read are written out once the index is synced to disk.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/seen.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+void usage()
+{
+	std::fprintf(stderr, "usage: geiger-dedup [-c] [-C chunks] [-a avg_log2] index\n");
+	std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	bool check = false;
+	std::uint64_t capacity = 1 << 24;
+	unsigned avg_log2 = 12;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cC:a:")) != -1) {
+		switch (opt) {
+		case 'c': check = true; break;
+		case 'C': capacity = std::strtoull(optarg, nullptr, 0); break;
+		case 'a': avg_log2 = std::strtoul(optarg, nullptr, 10); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || capacity == 0)
+		usage();
+
+	std::uint64_t chunks = 0, dups = 0, dup_bytes = 0;
+	try {
+		auto index = geiger::SeenIndex::open(argv[optind], check ? 0 : capacity, avg_log2);
+		geiger::Chunker chunker(index.chunk_log2());
+		std::vector<std::byte> in(1 << 16), chunk, out;
+		chunk.reserve(chunker.max_chunk());
+
+		auto finish = [&] {
+			chunks++;
+			bool fresh = check ? !index.contains(chunk) : index.insert(chunk);
+			if (!fresh) {
+				dups++;
+				dup_bytes += chunk.size();
+			} else if (!check) {
+				out.insert(out.end(), chunk.begin(), chunk.end());
+			}
+			chunk.clear();
+		};
+		// The index on disk first, then the chunks it has
+		auto write_out = [&] {
+			if (out.empty())
+				return;
+			index.sync();
+			if (std::fwrite(out.data(), 1, out.size(), stdout) != out.size())
+				std::exit(1);
+			out.clear();
+		};
+
+		for (;;) {
+			ssize_t got = read(0, in.data(), in.size());
+			if (got < 0) {
+				if (errno == EINTR)
+					continue;
+				std::perror("read");
+				return 1;
+			}
+			if (got == 0)
+				break;
+			std::span<const std::byte> rest(in.data(), static_cast<std::size_t>(got));
+			while (std::size_t n = chunker.next(rest)) {
+				chunk.insert(chunk.end(), rest.begin(), rest.begin() + n);
+				finish();
+				rest = rest.subspan(n);
+			}
+			chunk.insert(chunk.end(), rest.begin(), rest.end());
+			write_out();
+		}
+		if (!chunk.empty())
+			finish();
+		write_out();
+
+		std::fprintf(stderr, "geiger-dedup: %llu chunks, %llu seen before (%llu bytes), "
+			"index %llu of %llu\n", static_cast<unsigned long long>(chunks),
+			static_cast<unsigned long long>(dups), static_cast<unsigned long long>(dup_bytes),
+			static_cast<unsigned long long>(index.size()), static_cast<unsigned long long>(index.capacity()));
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "geiger-dedup: %s\n", e.what());
+		return 1;
+	}
+	if (std::fflush(stdout) != 0)
+		return 1;
+	return check && dups ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+/*
+	geiger-fill - fill a large file with a ChaCha20 keystream seeded by a GeigerRNG
+
+	For jobs that need far more random bytes than the generator makes, eg. test vectors or a
+	pool of key material: 32 bytes from geigerd key a ChaCha20 keystream (include/geiger/
+	chacha.hpp), which is written straight into the memory mapped output file by all cores.
+
+	Usage: geiger-fill [-s socket [-u uid] | -k key_hex] [-N nonce] [-j threads] -n size output
+
+	size may end in k, M or G (powers of 1024). With -k the key is given as 64 hex digits
+	instead of taken from the generator: this is the test mode, the same key, nonce and size
+	always give the same file, whatever -j is. Don't use it for anything secret. geigerd has to run
+	as root or as the same user, or as uid with -u.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/chacha.hpp"
+#include "geiger/source.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+void usage()
+{
+	std::fprintf(stderr, "usage: geiger-fill [-s socket [-u uid] | -k key_hex] [-N nonce] [-j threads] -n size output\n");
+	std::exit(2);
+}
+
+// A size with an optional k, M or G suffix, 0 if it doesn't parse
+std::size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long n = std::strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k': n <<= 10; end++; break;
+	case 'M': n <<= 20; end++; break;
+	case 'G': n <<= 30; end++; break;
+	}
+	return *end ? 0 : static_cast<std::size_t>(n);
+}
+
+bool parse_key(const char *hex, std::array<std::byte, geiger::ChaCha20::key_bytes> &key)
+{
+	if (std::strlen(hex) != 2 * key.size())
+		return false;
+	for (std::size_t i = 0; i < key.size(); i++) {
+		char byte[3] = { hex[2 * i], hex[2 * i + 1], 0 };
+		char *end;
+		key[i] = static_cast<std::byte>(std::strtoul(byte, &end, 16));
+		if (*end)
+			return false;
+	}
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string socket_path = geiger::default_socket();
+	uid_t server_uid = geiger::root_or_self;
+	std::array<std::byte, geiger::ChaCha20::key_bytes> key;
+	bool test_mode = false;
+	std::uint64_t nonce = 0;
+	unsigned threads = 0;
+	std::size_t size = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:u:k:N:j:n:")) != -1) {
+		switch (opt) {
+		case 's': socket_path = optarg; break;
+		case 'u': server_uid = std::strtoul(optarg, nullptr, 10); break;
+		case 'k':
+			if (!parse_key(optarg, key))
+				usage();
+			test_mode = true;
+			break;
+		case 'N': nonce = std::strtoull(optarg, nullptr, 0); break;
+		case 'j': threads = std::strtoul(optarg, nullptr, 10); break;
+		case 'n': size = parse_size(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || size == 0)
+		usage();
+
+	try {
+		if (test_mode)
+			std::fprintf(stderr, "geiger-fill: test mode, the output is reproducible\n");
+		else
+			geiger::Source::connect(socket_path, server_uid).read(key);
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "geiger-fill: %s\n", e.what());
+		return 1;
+	}
+	geiger::ChaCha20 chacha(key, nonce);
+	std::memset(key.data(), 0, key.size());
+
+	int fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) < 0) {
+		std::perror(argv[optind]);
+		return 1;
+	}
+	void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		std::perror("mmap");
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	geiger::bulk_fill(chacha, std::span(static_cast<std::byte *>(map), size), threads);
+	double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::fprintf(stderr, "geiger-fill: %zu bytes in %.2f s, %.2f GB/s, %s kernel\n", size, s,
+		static_cast<double>(size) / s / 1e9, chacha.kernel());
+
+	if (munmap(map, size) < 0 || close(fd) < 0) {
+		std::perror(argv[optind]);
+		return 1;
+	}
+	return 0;
+}
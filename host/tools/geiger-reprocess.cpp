@@ -0,0 +1,239 @@
+/*
+	geiger-reprocess - compare extraction methods on one recorded interval trace
+
+	Maps a trace of intervals (little endian 32 bit integers, as written by
+	"ricedecode.py -u32") into memory once and runs every selected extractor from
+	include/geiger/extract.hpp over it, on all cores. For each extractor it prints:
+
+	- bits/event: output bits per Geiger event (per interval),
+	- bias: P(1) - 1/2,
+	- H(bit): the MCV min-entropy per output bit, as minentropy.py computes it,
+	- H(byte)/8: the MCV min-entropy of the output bytes, per bit, which also sees
+	  dependence between neighbouring bits,
+	- Mev/s: intervals processed per second by one core.
+
+	Usage: geiger-reprocess [-j threads] [-c chunk_intervals] [-e name,name,...] [-l] trace.u32
+
+	-l lists the extractors. The trace is cut into chunks that are processed independently,
+	so an extractor that works on groups of bits loses the incomplete group at the end of
+	each chunk; with the default of 4M intervals that's negligible.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/extract.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace geiger::extract;
+
+namespace {
+
+// An extractor chain with the types erased
+struct Extractor {
+	std::string name;
+	std::size_t (*max_bits)(std::size_t intervals);
+	std::size_t (*run)(std::span<const std::uint32_t> iv, std::span<Bit> bits);
+};
+
+template <class First, class... Rest>
+Extractor make()
+{
+	using C = Chain<First, Rest...>;
+	return { C::name(), [](std::size_t n) { return C::max_bits(n); }, &C::run };
+}
+
+const std::vector<Extractor> extractors = {
+	make<Compare<>>(),
+	make<Compare<true>>(),
+	make<Compare<>, ParityFold<2>>(),
+	make<Compare<>, ParityFold<3>>(),
+	make<Compare<>, ParityFold<4>>(),
+	make<Compare<>, VonNeumann>(),
+	make<LowBits<1>>(),
+	make<LowBits<2>>(),
+	make<LowBits<3>>(),
+	make<LowBits<4>>(),
+	make<LowBits<4>, ParityFold<2>>(),
+	make<LowBits<8>>(),
+	make<LowBits<8>, VonNeumann>(),
+};
+
+struct Stats {
+	std::uint64_t bits = 0;
+	std::uint64_t ones = 0;
+	std::uint64_t bytes[256] = {};
+	std::uint64_t ns = 0;			// time spent in the extractor
+
+	Stats &operator+=(const Stats &o)
+	{
+		bits += o.bits;
+		ones += o.ones;
+		for (int i = 0; i < 256; i++)
+			bytes[i] += o.bytes[i];
+		ns += o.ns;
+		return *this;
+	}
+};
+
+// Most common value min-entropy estimate (SP 800-90B 6.3.1), as mcv() in minentropy.py
+double mcv(std::uint64_t most, std::uint64_t n)
+{
+	if (n < 2)
+		return NAN;
+	double p = double(most) / double(n);
+	double pu = std::min(1.0, p + 2.576 * std::sqrt(p * (1 - p) / double(n - 1)));
+	return -std::log2(pu);
+}
+
+void usage()
+{
+	std::fprintf(stderr, "usage: geiger-reprocess [-j threads] [-c chunk_intervals] [-e name,...] [-l] trace.u32\n");
+	std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	std::size_t chunk = 4 << 20;
+	std::vector<const Extractor *> selected;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:c:e:l")) != -1) {
+		switch (opt) {
+		case 'j': threads = std::max(1ul, std::strtoul(optarg, nullptr, 10)); break;
+		case 'c': chunk = std::strtoul(optarg, nullptr, 10) & ~std::size_t(63); break;
+		case 'e':
+			for (char *name = std::strtok(optarg, ","); name; name = std::strtok(nullptr, ",")) {
+				auto e = std::find_if(extractors.begin(), extractors.end(),
+					[&](const Extractor &x) { return x.name == name; });
+				if (e == extractors.end()) {
+					std::fprintf(stderr, "geiger-reprocess: no extractor %s, see -l\n", name);
+					return 2;
+				}
+				selected.push_back(&*e);
+			}
+			break;
+		case 'l':
+			for (auto &e : extractors)
+				std::printf("%s\n", e.name.c_str());
+			return 0;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || chunk == 0)
+		usage();
+	if (selected.empty())
+		for (auto &e : extractors)
+			selected.push_back(&e);
+	if constexpr (std::endian::native != std::endian::little) {
+		std::fprintf(stderr, "geiger-reprocess: traces are little endian, this host isn't\n");
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		std::perror(argv[optind]);
+		return 1;
+	}
+	std::size_t count = static_cast<std::size_t>(st.st_size) / sizeof(std::uint32_t);
+	if (count == 0) {
+		std::fprintf(stderr, "geiger-reprocess: %s is empty\n", argv[optind]);
+		return 1;
+	}
+	// MAP_POPULATE reads it all in before the clock starts, so the times are those of the
+	// extractors and not of the disk
+	void *map = mmap(nullptr, count * sizeof(std::uint32_t), PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		std::perror("mmap");
+		return 1;
+	}
+	// The advice values aren't flags, each takes a call of its own
+	madvise(map, count * sizeof(std::uint32_t), MADV_SEQUENTIAL);
+	madvise(map, count * sizeof(std::uint32_t), MADV_WILLNEED);
+	std::span<const std::uint32_t> trace(static_cast<const std::uint32_t *>(map), count);
+
+	// One task per chunk and extractor. Tasks go chunk by chunk, so all extractors work on
+	// the same part of the trace at a time and it is read from memory, not from disk, once.
+	const std::size_t chunks = (count + chunk - 1) / chunk;
+	const std::size_t tasks = chunks * selected.size();
+	std::size_t max_bits = 0;
+	for (auto *e : selected)
+		max_bits = std::max(max_bits, e->max_bits(std::min(chunk, count)));
+
+	std::atomic<std::size_t> next{0};
+	std::vector<std::vector<Stats>> stats(threads, std::vector<Stats>(selected.size()));
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::vector<std::jthread> pool;
+		for (unsigned t = 0; t < threads; t++) {
+			pool.emplace_back([&, t] {
+				std::vector<Bit> bits(max_bits);
+				std::vector<std::byte> bytes(max_bits / 8);
+				for (std::size_t task; (task = next.fetch_add(1, std::memory_order_relaxed)) < tasks;) {
+					std::size_t c = task / selected.size(), x = task % selected.size();
+					auto iv = trace.subspan(c * chunk, std::min(chunk, count - c * chunk));
+					Stats &s = stats[t][x];
+
+					auto t0 = std::chrono::steady_clock::now();
+					std::size_t n = selected[x]->run(iv, bits);
+					s.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now() - t0).count();
+
+					std::uint64_t ones = 0;
+					for (std::size_t i = 0; i < n; i++)
+						ones += bits[i];
+					s.bits += n;
+					s.ones += ones;
+					std::size_t nb = pack(std::span(bits).first(n), bytes);
+					for (std::size_t i = 0; i < nb; i++)
+						++s.bytes[static_cast<std::uint8_t>(bytes[i])];
+				}
+			});
+		}
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::printf("%zu intervals, %zu chunks, %u threads, %.2f s\n\n", count, chunks, threads, wall);
+	std::printf("%-22s %10s %10s %8s %10s %8s\n", "extractor", "bits/event", "bias", "H(bit)", "H(byte)/8", "Mev/s");
+	for (std::size_t x = 0; x < selected.size(); x++) {
+		Stats s;
+		for (auto &per_thread : stats)
+			s += per_thread[x];
+		std::uint64_t nbytes = 0, most = 0;
+		for (auto b : s.bytes) {
+			nbytes += b;
+			most = std::max(most, b);
+		}
+		double bias = s.bits ? double(s.ones) / double(s.bits) - 0.5 : NAN;
+		std::printf("%-22s %10.4f %+10.6f %8.5f %10.5f %8.1f\n", selected[x]->name.c_str(),
+			double(s.bits) / double(count), bias,
+			mcv(std::max(s.ones, s.bits - s.ones), s.bits), mcv(most, nbytes) / 8,
+			s.ns ? double(count) / (double(s.ns) / 1e3) : NAN);
+	}
+	munmap(map, count * sizeof(std::uint32_t));
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+	geiger-toeplitz - Toeplitz hash extractor for raw Geiger bits
+
+	Reads raw bits (binary, eg. from geigercat) on stdin and writes the extracted bits to
+	stdout. Every n input bits give m output bits, with m chosen from the min-entropy per
+	input bit that was assessed for the source (with minentropy.py, foldbias.py or
+	geiger-reprocess) so that the output is within 2^-security of uniform.
+
+	Usage: geiger-toeplitz -H min_entropy_per_bit [-n block_bits] [-e security]
+	                       [-s seed_file] [-j threads] < raw.bin > extracted.bin
+
+	The seed comes from seed_file (default geiger-toeplitz.seed). If the file doesn't exist,
+	a seed is made with getrandom() and saved there, so later runs use the same one. The seed
+	needn't be secret but it must not depend on the Geiger data.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/toeplitz.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+namespace {
+
+void usage()
+{
+	std::fprintf(stderr, "usage: geiger-toeplitz -H min_entropy_per_bit [-n block_bits] [-e security] "
+		"[-s seed_file] [-j threads]\n");
+	std::exit(2);
+}
+
+// Read the seed, or make one and save it
+std::vector<std::byte> load_seed(const std::string &path, std::size_t bytes)
+{
+	std::vector<std::byte> seed(bytes);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd >= 0) {
+		ssize_t got = read(fd, seed.data(), bytes);
+		close(fd);
+		if (got != static_cast<ssize_t>(bytes)) {
+			std::fprintf(stderr, "geiger-toeplitz: %s is shorter than the %zu bytes needed\n",
+				path.c_str(), bytes);
+			std::exit(1);
+		}
+		return seed;
+	}
+	if (errno != ENOENT) {
+		std::perror(path.c_str());
+		std::exit(1);
+	}
+	for (std::size_t n = 0; n < bytes;) {
+		ssize_t got = getrandom(seed.data() + n, bytes - n, 0);
+		if (got < 0 && errno != EINTR) {
+			std::perror("getrandom");
+			std::exit(1);
+		}
+		if (got > 0)
+			n += static_cast<std::size_t>(got);
+	}
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 || write(fd, seed.data(), bytes) != static_cast<ssize_t>(bytes) || close(fd) < 0) {
+		std::perror(path.c_str());
+		std::exit(1);
+	}
+	std::fprintf(stderr, "geiger-toeplitz: new seed saved in %s\n", path.c_str());
+	return seed;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	double h = 0;
+	std::size_t n = 4096;
+	unsigned security = 64;
+	std::string seed_path = "geiger-toeplitz.seed";
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	int opt;
+
+	while ((opt = getopt(argc, argv, "H:n:e:s:j:")) != -1) {
+		switch (opt) {
+		case 'H': h = std::strtod(optarg, nullptr); break;
+		case 'n': n = std::strtoul(optarg, nullptr, 10); break;
+		case 'e': security = std::strtoul(optarg, nullptr, 10); break;
+		case 's': seed_path = optarg; break;
+		case 'j': threads = std::max(1ul, std::strtoul(optarg, nullptr, 10)); break;
+		default: usage();
+		}
+	}
+	if (optind != argc || h <= 0 || h > 1 || n == 0 || n % 64)
+		usage();
+	std::size_t m = geiger::Toeplitz::output_bits(n, h, security);
+	if (m == 0) {
+		std::fprintf(stderr, "geiger-toeplitz: %zu bits at %g bits of entropy each are too few for "
+			"2^-%u, use a larger -n\n", n, h, security);
+		return 1;
+	}
+
+	try {
+		geiger::Toeplitz t(n, m, load_seed(seed_path, geiger::Toeplitz::seed_bytes(n, m)));
+		std::fprintf(stderr, "geiger-toeplitz: %zu -> %zu bits per block, %s kernel\n", n, m, t.kernel());
+
+		// Enough room to give every thread some blocks
+		const std::size_t batch = std::max<std::size_t>(64, 16 * threads);
+		std::vector<std::byte> in(batch * t.input_bytes()), out(batch * t.output_bytes());
+		std::size_t have = 0;
+
+		// Whatever whole blocks have arrived are extracted right away, a live generator is slow
+		for (;;) {
+			ssize_t got = read(0, in.data() + have, in.size() - have);
+			if (got < 0) {
+				if (errno == EINTR)
+					continue;
+				std::perror("read");
+				return 1;
+			}
+			have += static_cast<std::size_t>(got);
+			std::size_t blocks = have / t.input_bytes();
+			if (got == 0 && blocks == 0)
+				break;		// end of input, a partial block is dropped
+			if (blocks == 0)
+				continue;
+
+			// Blocks are independent, each thread takes a contiguous share
+			std::size_t per = (blocks + threads - 1) / threads;
+			{
+				std::vector<std::jthread> pool;
+				for (std::size_t first = 0; first < blocks; first += per) {
+					std::size_t count = std::min(per, blocks - first);
+					pool.emplace_back([&, first, count] {
+						t.extract(std::span(in).subspan(first * t.input_bytes(), count * t.input_bytes()),
+							std::span(out).subspan(first * t.output_bytes(), count * t.output_bytes()));
+					});
+				}
+			}
+			if (std::fwrite(out.data(), t.output_bytes(), blocks, stdout) != blocks)
+				return 1;
+			std::fflush(stdout);
+			have -= blocks * t.input_bytes();
+			std::copy_n(in.begin() + blocks * t.input_bytes(), have, in.begin());
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "geiger-toeplitz: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
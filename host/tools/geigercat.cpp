@@ -0,0 +1,96 @@
+/*
+	geigercat - copy random bytes from a GeigerRNG to stdout, as binary
+
+	Usage: geigercat [-s socket [-u uid] [-m ring_bytes] | -t serial_port [-b baud] [-r status_file]]
+	                 [-n bytes]
+
+	Reads from geigerd by default, through a shared ring with -m, or straight from the serial
+	port with -t. geigerd has to run as root or as the same user, or as uid with -u. Without -n it runs until stdout is closed. With -r, the firmware's status lines
+	(eg. the "#rad" reports of firmware built with RADLOG) are appended to status_file, "-" for
+	stderr, as they arrive, so one GeigerRNG feeds both a radiation log and the random bytes.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/source.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+	std::string socket_path = geiger::default_socket();
+	uid_t server_uid = geiger::root_or_self;
+	std::string tty;
+	unsigned baud = 9600;
+	std::size_t ring = 0;
+	long long count = -1;
+	const char *status_path = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:u:t:b:m:n:r:")) != -1) {
+		switch (opt) {
+		case 's': socket_path = optarg; break;
+		case 'u': server_uid = std::strtoul(optarg, nullptr, 10); break;
+		case 't': tty = optarg; break;
+		case 'b': baud = std::strtoul(optarg, nullptr, 10); break;
+		case 'm': ring = std::strtoul(optarg, nullptr, 10); break;
+		case 'n': count = std::strtoll(optarg, nullptr, 10); break;
+		case 'r': status_path = optarg; break;
+		default:
+			std::fprintf(stderr, "usage: geigercat [-s socket [-u uid] [-m ring_bytes] | -t serial_port [-b baud] "
+				"[-r status_file]] [-n bytes]\n");
+			return 2;
+		}
+	}
+	if (status_path && tty.empty()) {
+		std::fprintf(stderr, "geigercat: -r needs -t, geigerd doesn't pass the status lines on\n");
+		return 2;
+	}
+
+	try {
+		geiger::Source src = !tty.empty() ? geiger::Source::open_serial(tty, baud) :
+			ring ? geiger::Source::connect_shared(socket_path, ring, server_uid) :
+			geiger::Source::connect(socket_path, server_uid);
+		std::array<std::byte, 4096> buf;
+
+		if (status_path) {
+			std::FILE *status = std::strcmp(status_path, "-") == 0 ? stderr : std::fopen(status_path, "a");
+			if (!status) {
+				std::perror(status_path);
+				return 1;
+			}
+			src.on_status([status](std::string_view line) {
+				std::fprintf(status, "%.*s\n", static_cast<int>(line.size()), line.data());
+				std::fflush(status);
+			});
+		}
+
+		while (count != 0) {
+			std::size_t n = buf.size();
+			if (count > 0 && static_cast<unsigned long long>(count) < n)
+				n = static_cast<std::size_t>(count);
+			// Pass every piece on as it comes, the generator is slow
+			src.read(std::span(buf).first(n), [](std::span<const std::byte> chunk) {
+				if (std::fwrite(chunk.data(), 1, chunk.size(), stdout) != chunk.size())
+					std::exit(0);
+				std::fflush(stdout);
+			});
+			if (count > 0)
+				count -= static_cast<long long>(n);
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "geigercat: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
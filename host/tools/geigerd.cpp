@@ -0,0 +1,670 @@
+/*
+	geigerd - local entropy service for a GeigerRNG
+
+	Owns the serial ports of one or more GeigerRNGs, keeps the random bytes they print in a pool
+	and hands them to clients on a Unix socket, so several programs can share the generators.
+	Clients use geiger::Source::connect(); the protocol is described in
+	include/geiger/source.hpp. The socket is $XDG_RUNTIME_DIR/geigerd.sock, or
+	/run/geigerd/geigerd.sock when run as root; its directory must not be writable by others. Requests that have to wait are served in the order they arrived.
+	A client that doesn't take its answer within half a second is disconnected.
+
+	Every device's bytes go through the SP 800-90B health tests (include/geiger/health.hpp)
+	on their way to the pool, with cutoffs set by -H, the min-entropy per bit the devices were
+	assessed at. With -c, the count rate implied by each device's byte rate over a minute must
+	also lie between min_cpm and max_cpm; -e is the number of Geiger events behind each byte,
+	32 for the default firmware. A device that fails is quarantined: its bytes are thrown away
+	until it has passed the tests on a whole window of 512 bytes, or for a rate failure until a
+	minute with a plausible rate. Bytes that reached the pool before the failure stay there.
+
+	With -d, no bytes are served twice, even across restarts or when a device replays a capture:
+	after the health tests each device's bytes are cut into chunks and every chunk is looked up
+	in a persistent index (include/geiger/seen.hpp), made for -C chunks if it doesn't exist.
+	Only chunks that weren't there go to the pool, once the index is synced to disk. Bytes are
+	held back until their chunk ends, 4 KiB on average, and geigerd stops when the index is full. The same index can be used by
+	geiger-dedup on captures, but not while geigerd runs.
+
+	Clients that asked for a shared ring (Source::connect_shared()) are topped up from the pool
+	whenever no request is waiting, so they get what the others leave. Filling a ring takes no
+	system call, and waking a client or being woken by it an eventfd write, so a busy shared
+	client costs geigerd far less than one sending a request for every read.
+
+	With -q, every device's stream is also watched over a sliding window of window_kib KiB
+	(include/geiger/monitor.hpp): the share of ones, overall and per bit position, the byte
+	chi-square, the serial correlation at lags 1 to 8 and the number of runs. When one of them
+	is more than z standard deviations (6 by default) from what good random bytes give, an
+	alarm is logged, and again when they are all back within bounds. An alarm doesn't stop the
+	device, it warns of a slow degradation before the health tests catch it, or that they won't.
+	Only one block of window_kib/16 KiB in every sample (4 by default) is looked at, which keeps
+	the cost under 3% of reading the device; the window is sampled from the last sample *
+	window_kib KiB. -q 64:6:1 watches every byte, at about 10%.
+
+	With -r, the devices' status lines, such as the "#rad" radiation reports of firmware built
+	with RADLOG, are appended to status_file as "<unix time> <device> <line>", so a monitor can
+	follow the source through the same serial link the random bytes come over. A device is only
+	read while the pool has room, its reports wait as long.
+
+	Usage: geigerd [-s socket] [-b baud] [-p pool_kib] [-H min_entropy_per_bit]
+	               [-c min_cpm:max_cpm [-e events_per_byte]] [-d index [-C chunks]]
+	               [-q window_kib[:z[:sample]]] [-r status_file] /dev/ttyUSB0...
+
+	The firmware has to be in a mode that prints random bytes without stopping, for example
+	continuous mode, or "B0" and "G" sent through its command channel.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include "geiger/health.hpp"
+#include "geiger/monitor.hpp"
+#include "geiger/ring.hpp"
+#include "geiger/seen.hpp"
+#include "geiger/shared_ring.hpp"
+#include "geiger/source.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+struct Client {
+	int fd;
+	std::uint32_t want = 0;			// bytes asked for by the pending request
+	geiger::Wait wait = geiger::Wait::none;
+	bool pending = false;
+	std::uint8_t hdr[4] = {};		// request being received
+	std::uint8_t hdr_len = 0;
+	// Shared ring only
+	geiger::SharedRing *ring = nullptr;
+	std::size_t ring_size = 0;
+	std::uint64_t head = 0;			// bytes written, kept here as the client can write the mapping
+	int data_fd = -1;
+	int space_fd = -1;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// After a failed health test a device has to pass this many bytes before it is used again
+constexpr std::size_t probation_bytes = geiger::HealthTest::apt_window;
+constexpr Clock::duration rate_window = std::chrono::minutes(1);
+// A client has this long to take an answer, everything else waits meanwhile
+constexpr Clock::duration send_timeout = std::chrono::milliseconds(500);
+
+struct Device {
+	std::string path;
+	geiger::Source src;
+	geiger::HealthTest health;
+	std::size_t probation = 0;		// bytes still to pass, the device is quarantined while > 0
+	bool rate_ok = true;			// the last count rate check passed
+	// Count rate check: bytes since the window started. A window in which the pool was full
+	// (and the device wasn't read) doesn't count.
+	Clock::time_point window_start = Clock::now();
+	std::uint64_t window_bytes = 0;
+	bool throttled = false;
+	// With an index: the chunk being received, and the tail of new chunks that didn't fit in
+	// the pool yet
+	geiger::Chunker chunker = geiger::Chunker();
+	std::vector<std::byte> held = {};
+	std::vector<std::byte> approved = {};
+	// With -q: the sliding window statistics, and whether they are in alarm
+	std::optional<geiger::QualityMonitor> quality = std::nullopt;
+	bool quality_alarm = false;
+};
+
+struct RateLimits {
+	double min_cpm = 0, max_cpm = 0;	// max_cpm 0: no check
+	double events_per_byte = 32;
+};
+
+volatile std::sig_atomic_t stop;
+
+void on_signal(int)
+{
+	stop = 1;
+}
+
+void usage()
+{
+	std::fprintf(stderr, "usage: geigerd [-s socket] [-b baud] [-p pool_kib] [-H min_entropy_per_bit]\n"
+		"               [-c min_cpm:max_cpm [-e events_per_byte]] [-d index [-C chunks]]\n"
+		"               [-q window_kib[:z[:sample]]] [-r status_file] serial_port...\n");
+	std::exit(2);
+}
+
+// The socket's directory is made if it doesn't exist. It must belong to root or to us, and no one
+// else may write to it, or another user could put a socket of their own in its place.
+int listen_on(const std::string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	const auto slash = path.rfind('/');
+	const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	struct stat st;
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+		throw std::system_error(errno, std::generic_category(), dir);
+	if (stat(dir.c_str(), &st) < 0)
+		throw std::system_error(errno, std::generic_category(), dir);
+	if ((st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH)))
+		throw std::system_error(EPERM, std::generic_category(), dir + " can be written by other users");
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "socket");
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 16) < 0)
+		throw std::system_error(errno, std::generic_category(), path);
+	return fd;
+}
+
+// Send all of buf on a non-blocking socket. Returns false if the client is gone or hasn't
+// taken it by the deadline.
+bool send_all(int fd, const void *buf, std::size_t n, Clock::time_point deadline)
+{
+	auto *p = static_cast<const char *>(buf);
+
+	while (n > 0) {
+		ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+				if (left.count() <= 0)
+					return false;
+				pollfd w = { fd, POLLOUT, 0 };
+				poll(&w, 1, static_cast<int>(left.count()));
+				continue;
+			}
+			return false;
+		}
+		p += sent;
+		n -= static_cast<std::size_t>(sent);
+	}
+	return true;
+}
+
+// Disconnect a client, it is removed from the list later
+void drop(Client &c)
+{
+	if (c.ring)
+		munmap(c.ring, geiger::shared_ring_offset + c.ring_size);
+	for (int fd : { c.fd, c.data_fd, c.space_fd })
+		if (fd >= 0)
+			close(fd);
+	c.ring = nullptr;
+	c.fd = c.data_fd = c.space_fd = -1;
+}
+
+// Make a shared ring of at least size bytes for a client and send it the descriptors
+bool share_ring(Client &c, std::size_t size)
+{
+	size = std::bit_ceil(std::clamp(size, geiger::min_shared_ring, geiger::max_shared_ring));
+	const std::size_t bytes = geiger::shared_ring_offset + size;
+
+	// Sealed, so the client can't shrink it under us
+	int mem = memfd_create("geigerd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mem < 0)
+		return false;
+	void *map = MAP_FAILED;
+	if (ftruncate(mem, static_cast<off_t>(bytes)) == 0 &&
+			fcntl(mem, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+		map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+	if (map == MAP_FAILED) {
+		close(mem);
+		return false;
+	}
+	c.ring = static_cast<geiger::SharedRing *>(map);		// the memfd is zero filled
+	c.ring_size = size;
+	c.data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	c.space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	std::uint32_t n = static_cast<std::uint32_t>(size);
+	std::uint8_t hdr[4] = {
+		static_cast<std::uint8_t>(n), static_cast<std::uint8_t>(n >> 8),
+		static_cast<std::uint8_t>(n >> 16), static_cast<std::uint8_t>(n >> 24)
+	};
+	int fds[3] = { mem, c.data_fd, c.space_fd };
+	iovec iov = { hdr, sizeof(hdr) };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	std::memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	bool ok = c.data_fd >= 0 && c.space_fd >= 0 &&
+		sendmsg(c.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(hdr);
+	close(mem);
+	return ok;
+}
+
+// Copy what fits from the pool into a client's shared ring, and wake the client if it waits.
+// The flags are explained in include/geiger/shared_ring.hpp. Returns false if the client has
+// made a mess of the ring.
+bool top_up(Client &c, geiger::ByteRing &pool)
+{
+	geiger::SharedRing *r = c.ring;
+	std::byte *data = reinterpret_cast<std::byte *>(r) + geiger::shared_ring_offset;
+
+	for (;;) {
+		std::uint64_t used = c.head - r->tail.load(std::memory_order_acquire);
+		if (used > c.ring_size)
+			return false;
+		std::size_t n = std::min(c.ring_size - used, pool.size());
+		if (n > 0) {
+			// From the (at most two) pieces of the pool to the (at most two) pieces of the ring
+			std::size_t done = 0;
+			for (auto span : pool.read_spans()) {
+				std::size_t take = std::min(span.size(), n - done);
+				for (std::size_t k = 0; k < take;) {
+					std::size_t at = (c.head + done) & (c.ring_size - 1);
+					std::size_t len = std::min(take - k, c.ring_size - at);
+					std::memcpy(data + at, span.data() + k, len);
+					k += len;
+					done += len;
+				}
+			}
+			pool.drop(n);
+			c.head += n;
+			r->head.store(c.head);
+			if (r->reader_waiting.load() && r->reader_waiting.exchange(0))
+				eventfd_write(c.data_fd, 1);
+		}
+		if (pool.empty())
+			return true;
+		// Full: ask to be woken when half of it is free, unless it already is
+		r->writer_waiting.store(1);
+		if (c.head - r->tail.load() > c.ring_size / 2)
+			return true;
+		r->writer_waiting.store(0);
+	}
+}
+
+bool quarantined(const Device &d)
+{
+	return d.probation > 0 || !d.rate_ok;
+}
+
+void report(const Device &d, bool was_quarantined, const char *why)
+{
+	if (quarantined(d) && !was_quarantined)
+		std::fprintf(stderr, "geigerd: %s: %s, quarantined\n", d.path.c_str(), why);
+	else if (!quarantined(d) && was_quarantined)
+		std::fprintf(stderr, "geigerd: %s: back in use\n", d.path.c_str());
+}
+
+// Add bytes to the pool as far as they fit, returns how many did
+std::size_t to_pool(geiger::ByteRing &pool, std::span<const std::byte> bytes)
+{
+	std::size_t done = 0;
+	while (done < bytes.size() && !pool.full()) {
+		auto span = pool.write_span();
+		std::size_t len = std::min(span.size(), bytes.size() - done);
+		std::memcpy(span.data(), bytes.data() + done, len);
+		pool.commit(len);
+		done += len;
+	}
+	return done;
+}
+
+// Move a device's approved chunks to the pool, as far as they fit
+void flush(Device &d, geiger::ByteRing &pool)
+{
+	std::size_t n = to_pool(pool, d.approved);
+	d.approved.erase(d.approved.begin(), d.approved.begin() + static_cast<std::ptrdiff_t>(n));
+}
+
+// Cut tested bytes into chunks and keep those the index hasn't seen
+void dedup(Device &d, geiger::SeenIndex &index, std::span<const std::byte> bytes)
+{
+	while (std::size_t n = d.chunker.next(bytes)) {
+		d.held.insert(d.held.end(), bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(n));
+		if (index.insert(d.held))
+			d.approved.insert(d.approved.end(), d.held.begin(), d.held.end());
+		else
+			std::fprintf(stderr, "geigerd: %s: %zu bytes served before, dropped\n", d.path.c_str(),
+				d.held.size());
+		d.held.clear();
+		bytes = bytes.subspan(n);
+	}
+	d.held.insert(d.held.end(), bytes.begin(), bytes.end());
+}
+
+// Update a device's sliding window statistics, and log when an alarm starts or ends
+void watch(Device &d, std::span<const std::byte> bytes)
+{
+	auto result = d.quality->run(bytes);
+	if ((result != geiger::QualityMonitor::Result::ok) == d.quality_alarm)
+		return;
+	d.quality_alarm = !d.quality_alarm;
+	if (!d.quality_alarm) {
+		std::fprintf(stderr, "geigerd: %s: quality back to normal\n", d.path.c_str());
+		return;
+	}
+	auto s = d.quality->stats();
+	std::fprintf(stderr, "geigerd: %s: quality alarm, %s: over %zu bytes frequency z %.1f, "
+		"bit %u z %.1f, chi-square %.0f (z %.1f), lag %u z %.1f, runs z %.1f\n", d.path.c_str(),
+		geiger::QualityMonitor::name(result), s.bytes, s.frequency, s.worst_bit, s.bit_position,
+		s.chi_square, s.chi_square_z, s.worst_lag, s.correlation, s.runs);
+}
+
+// Read what a device has, test it and add it to the pool unless the device is quarantined.
+// With an index, only new chunks are added. Returns false when the device is gone.
+bool ingest(Device &d, geiger::ByteRing &pool, geiger::SeenIndex *index, bool hangup)
+{
+	std::array<std::byte, 512> chunk;
+	std::size_t n = d.src.read_some(std::span(chunk).first(index ? chunk.size() :
+		std::min(chunk.size(), pool.space())));
+	if (n == 0)
+		return !hangup;
+	d.window_bytes += n;
+	if (d.quality)
+		watch(d, std::span(chunk).first(n));
+
+	const bool was = quarantined(d);
+	auto result = d.health.run(std::span(chunk).first(n));
+	if (result != geiger::HealthTest::Result::ok) {
+		// The whole read is thrown away, but its bytes after the failure have been tested, so
+		// the probation starts after it
+		d.probation = probation_bytes;
+		// The chunk being received has failed bytes in it
+		d.held.clear();
+		d.chunker.reset();
+		report(d, was, geiger::HealthTest::name(result));
+		return true;
+	}
+	if (was) {
+		// These bytes only count towards the probation
+		d.probation -= std::min(n, d.probation);
+		report(d, was, "");
+		return true;
+	}
+	if (index) {
+		dedup(d, *index, std::span(chunk).first(n));
+		index->sync();		// on disk before any of the chunks can be served
+		flush(d, pool);
+	} else {
+		to_pool(pool, std::span(chunk).first(n));
+	}
+	return true;
+}
+
+// Check the count rate of a device whose window is over
+void check_rate(Device &d, const RateLimits &limits, Clock::time_point now)
+{
+	if (!d.throttled) {
+		const bool was = quarantined(d);
+		double minutes = std::chrono::duration<double>(now - d.window_start).count() / 60;
+		double cpm = static_cast<double>(d.window_bytes) * limits.events_per_byte / minutes;
+		d.rate_ok = cpm >= limits.min_cpm && cpm <= limits.max_cpm;
+		char why[64];
+		std::snprintf(why, sizeof(why), "implausible count rate of %.0f CPM", cpm);
+		report(d, was, why);
+	}
+	d.window_start = now;
+	d.window_bytes = 0;
+	d.throttled = false;
+}
+
+// Answer a client's pending request with count bytes from the pool
+bool reply(Client &c, geiger::ByteRing &pool, std::size_t count)
+{
+	std::uint32_t n = static_cast<std::uint32_t>(count);
+	std::uint8_t hdr[4] = {
+		static_cast<std::uint8_t>(n), static_cast<std::uint8_t>(n >> 8),
+		static_cast<std::uint8_t>(n >> 16), static_cast<std::uint8_t>(n >> 24)
+	};
+	const auto deadline = Clock::now() + send_timeout;
+	bool ok = send_all(c.fd, hdr, sizeof(hdr), deadline);
+	auto spans = pool.read_spans();
+	std::size_t first = std::min(count, spans[0].size());
+	ok = ok && send_all(c.fd, spans[0].data(), first, deadline);
+	ok = ok && send_all(c.fd, spans[1].data(), count - first, deadline);
+	pool.drop(count);
+	c.pending = false;
+	return ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string socket_path = geiger::default_socket();
+	unsigned baud = 9600;
+	std::size_t pool_kib = 64;
+	double h = 0.9;
+	RateLimits limits;
+	const char *index_path = nullptr;
+	std::uint64_t index_capacity = 1 << 24;
+	const char *status_path = nullptr;
+	std::size_t quality_kib = 0;
+	unsigned quality_sample = 4;
+	geiger::QualityLimits quality_limits;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:p:H:c:e:d:C:r:q:")) != -1) {
+		switch (opt) {
+		case 's': socket_path = optarg; break;
+		case 'b': baud = std::strtoul(optarg, nullptr, 10); break;
+		case 'p': pool_kib = std::strtoul(optarg, nullptr, 10); break;
+		case 'H': h = std::strtod(optarg, nullptr); break;
+		case 'c':
+			if (std::sscanf(optarg, "%lf:%lf", &limits.min_cpm, &limits.max_cpm) != 2 ||
+					limits.max_cpm <= limits.min_cpm)
+				usage();
+			break;
+		case 'e': limits.events_per_byte = std::strtod(optarg, nullptr); break;
+		case 'd': index_path = optarg; break;
+		case 'C': index_capacity = std::strtoull(optarg, nullptr, 0); break;
+		case 'r': status_path = optarg; break;
+		case 'q': {
+			double z = 6;
+			if (std::sscanf(optarg, "%zu:%lf:%u", &quality_kib, &z, &quality_sample) < 1 || z <= 0 ||
+					quality_sample < 1)
+				usage();
+			quality_limits = { z, z, z, z, z };
+			break;
+		}
+		default: usage();
+		}
+	}
+	if (optind == argc || pool_kib == 0 || limits.events_per_byte <= 0)
+		usage();
+
+	std::signal(SIGINT, on_signal);
+	std::signal(SIGTERM, on_signal);
+
+	try {
+		std::optional<geiger::SeenIndex> index;
+		if (index_path)
+			index = geiger::SeenIndex::open(index_path, index_capacity);
+		std::FILE *status = nullptr;
+		if (status_path && !(status = std::fopen(status_path, "a")))
+			throw std::system_error(errno, std::generic_category(), status_path);
+		std::vector<Device> devices;
+		for (int i = optind; i < argc; i++) {
+			devices.push_back({ argv[i], geiger::Source::open_serial(argv[i], baud), geiger::HealthTest(h) });
+			if (index)
+				devices.back().chunker = geiger::Chunker(index->chunk_log2());
+			if (quality_kib)
+				devices.back().quality.emplace(quality_kib * 1024, 8, quality_limits, quality_sample);
+			if (status) {
+				devices.back().src.on_status([status, path = argv[i]](std::string_view line) {
+					std::fprintf(status, "%lld %s %.*s\n", static_cast<long long>(std::time(nullptr)), path,
+						static_cast<int>(line.size()), line.data());
+					std::fflush(status);
+				});
+			}
+		}
+		geiger::ByteRing pool(pool_kib * 1024);
+		int listener = listen_on(socket_path);
+		std::vector<Client> clients;
+		std::deque<int> queue;		// fds of clients waiting for bytes, oldest first
+		std::vector<pollfd> fds;
+
+		while (!stop) {
+			// Serve waiting requests in order, as far as the pool goes
+			while (!queue.empty()) {
+				Client *c = nullptr;
+				for (auto &cl : clients)
+					if (cl.fd == queue.front())
+						c = &cl;
+				if (!c || !c->pending) {
+					queue.pop_front();
+					continue;
+				}
+				std::size_t n = std::min<std::size_t>(c->want, pool.size());
+				if (c->wait == geiger::Wait::all ? n < c->want :
+						c->wait == geiger::Wait::some && n == 0)
+					break;
+				queue.pop_front();
+				if (!reply(*c, pool, n))
+					drop(*c);
+			}
+			// Then the shared rings get what is left
+			if (queue.empty())
+				for (auto &c : clients)
+					if (c.ring && !top_up(c, pool))
+						drop(c);
+			std::erase_if(clients, [](const Client &c) { return c.fd < 0; });
+
+			// Count rate windows that are over, and when the next one ends
+			int timeout = -1;
+			if (limits.max_cpm > 0) {
+				auto now = Clock::now();
+				for (auto &d : devices) {
+					if (now - d.window_start >= rate_window)
+						check_rate(d, limits, now);
+					auto left = std::chrono::ceil<std::chrono::milliseconds>(d.window_start + rate_window - now);
+					if (timeout < 0 || left.count() < timeout)
+						timeout = static_cast<int>(left.count());
+				}
+			}
+
+			fds.clear();
+			// Stop reading the generators while the pool is full, the ttys buffer the rest. A
+			// device with approved chunks left waits until they are all in.
+			for (auto &d : devices) {
+				flush(d, pool);
+				bool wait = pool.full() || !d.approved.empty();
+				d.throttled |= wait;
+				fds.push_back({ d.src.native_handle(), static_cast<short>(wait ? 0 : POLLIN), 0 });
+			}
+			const std::size_t first_client = devices.size() + 1;
+			fds.push_back({ listener, POLLIN, 0 });
+			for (auto &c : clients)
+				fds.push_back({ c.fd, POLLIN, 0 });
+			// Shared ring clients wake us through space_fd, after the sockets
+			for (auto &c : clients)
+				if (c.ring)
+					fds.push_back({ c.space_fd, POLLIN, 0 });
+			if (poll(fds.data(), fds.size(), timeout) < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "poll");
+			}
+
+			for (std::size_t i = 0; i < devices.size(); i++) {
+				Device &d = devices[i];
+				short ev = fds[i].revents;
+				if ((ev & (POLLIN | POLLHUP | POLLERR)) && !pool.full() &&
+						!ingest(d, pool, index ? &*index : nullptr, ev & (POLLHUP | POLLERR))) {
+					std::fprintf(stderr, "geigerd: %s: closed\n", d.path.c_str());
+					d.path.clear();
+				}
+			}
+			std::erase_if(devices, [](const Device &d) { return d.path.empty(); });
+			if (devices.empty())
+				throw std::system_error(EIO, std::generic_category(), "no serial port left");
+			// The clients that were polled, a new one is added after them
+			const std::size_t polled = clients.size();
+			if (fds[first_client - 1].revents & POLLIN) {
+				int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (fd >= 0)
+					clients.push_back({ fd });
+			}
+			for (std::size_t i = first_client + polled; i < fds.size(); i++) {
+				eventfd_t v;
+				if (fds[i].revents)
+					eventfd_read(fds[i].fd, &v);	// topped up at the top of the loop
+			}
+			for (std::size_t i = first_client; i < first_client + polled; i++) {
+				if (!fds[i].revents)
+					continue;
+				Client &c = clients[i - first_client];
+				ssize_t got = recv(c.fd, c.hdr + c.hdr_len, sizeof(c.hdr) - c.hdr_len, MSG_DONTWAIT);
+				if (got < 0 && (errno == EINTR || errno == EAGAIN))
+					continue;
+				if (got <= 0 || c.pending || c.ring) {
+					// Gone, a second request before the answer to the first, or a request
+					// after a shared ring
+					drop(c);
+					continue;
+				}
+				c.hdr_len += static_cast<std::uint8_t>(got);
+				if (c.hdr_len < sizeof(c.hdr))
+					continue;
+				c.hdr_len = 0;
+				std::uint32_t req = c.hdr[0] | c.hdr[1] << 8 | c.hdr[2] << 16 |
+					static_cast<std::uint32_t>(c.hdr[3]) << 24;
+				c.want = req & geiger::request_count_mask;
+				if (req >> geiger::request_wait_shift == geiger::request_shared) {
+					if (!share_ring(c, c.want))
+						drop(c);
+					continue;
+				}
+				c.wait = static_cast<geiger::Wait>(req >> geiger::request_wait_shift);
+				if (c.want > geiger::max_request || c.want > pool.capacity()) {
+					drop(c);
+					continue;
+				}
+				c.pending = true;
+				queue.push_back(c.fd);
+			}
+			std::erase_if(clients, [](const Client &c) { return c.fd < 0; });
+		}
+		for (auto &c : clients)
+			drop(c);
+		close(listener);
+		unlink(socket_path.c_str());
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "geigerd: %s\n", e.what());
+		unlink(socket_path.c_str());
+		return 1;
+	}
+	return 0;
+}
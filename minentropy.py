@@ -0,0 +1,100 @@
+# Min-entropy estimates for a capture made with the RAW_EVENTS firmware.
+#
+# Usage: python minentropy.py < capture.log
+#
+# Each line of the capture is "interval" or "interval,width" in hex, in Timer1 ticks: 1 us on
+# the ATtiny2313, 0.5 us on the ATmega328P.
+# Lines starting with '#' are ignored. For each way of turning the timing data into
+# bits, the most common value estimate of NIST SP 800-90B (section 6.3.1) is printed,
+# once for single bits and once for 8 bit blocks, together with the yield in bits
+# per Geiger event.
+from __future__ import division, print_function
+
+import sys
+import math
+from collections import Counter
+
+def mcv(symbols):
+    """Most common value min-entropy estimate, in bits per symbol."""
+    n = len(symbols)
+    if n < 2:
+        return float('nan')
+    p = Counter(symbols).most_common(1)[0][1] / n
+    pu = min(1.0, p + 2.576 * math.sqrt(p * (1 - p) / (n - 1)))
+    return -math.log(pu, 2)
+
+def blocks(bits, n=8):
+    return [tuple(bits[i:i+n]) for i in range(0, len(bits) - n + 1, n)]
+
+def interval_bits(intervals):
+    """The firmware's method: 4 events, T4 - T3 > T2 - T1, ties give 0."""
+    bits = []
+    ties = 0
+    for i in range(0, len(intervals) - 3, 4):
+        a, c = intervals[i], intervals[i+2]
+        if a == c:
+            ties += 1
+        bits.append(1 if c > a else 0)
+    return bits, ties
+
+def width_bits(widths):
+    """PULSE_WIDTH: two consecutive widths are compared, ties are thrown away."""
+    bits = []
+    ties = 0
+    for i in range(0, len(widths) - 1, 2):
+        a, b = widths[i], widths[i+1]
+        if a == b:
+            ties += 1
+        else:
+            bits.append(1 if b > a else 0)
+    return bits, ties
+
+def report(name, bits, events, ties):
+    if not bits:
+        print('%-22s no data' % name)
+        return
+    ones = sum(bits)
+    print('%-22s %9d %8.5f %8.5f %8.5f %8.4f %7.2f%%' % (name, len(bits),
+        ones / len(bits), mcv(bits), mcv(blocks(bits)) / 8,
+        len(bits) / events, 100.0 * ties / events))
+
+def main(input):
+    intervals = []
+    widths = []
+    for line in input:
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
+        fields = line.split(',')
+        intervals.append(int(fields[0], 16))
+        if len(fields) > 1:
+            widths.append(int(fields[1], 16))
+
+    events = len(intervals)
+    if events == 0:
+        print('no events in capture')
+        return
+    print('%d events, mean interval %.1f ticks' % (events, sum(intervals) / events))
+    if widths:
+        print('mean pulse width %.1f ticks, %d distinct widths' %
+              (sum(widths) / len(widths), len(set(widths))))
+    print()
+    print('%-22s %9s %8s %8s %8s %8s %8s' % ('source', 'bits', 'P(1)', 'H/bit',
+                                            'H/bit(8)', 'bits/ev', 'ties'))
+
+    bits, ties = interval_bits(intervals)
+    report('interval comparison', bits, events, ties)
+    if widths:
+        bits, ties = width_bits(widths)
+        report('width comparison', bits, events, ties)
+    for b in (1, 2, 4):
+        low = [x & ((1 << b) - 1) for x in intervals]
+        print('%-22s %9d %8s %8.5f %8s %8d' % ('interval low %d bits' % b, events, '',
+                                            mcv(low) / b, '', b))
+        if widths:
+            low = [x & ((1 << b) - 1) for x in widths]
+            print('%-22s %9d %8s %8.5f %8s %8d' % ('width low %d bits' % b, len(low), '',
+                                                mcv(low) / b, '', b))
+
+if __name__ == '__main__':
+    main(sys.stdin)
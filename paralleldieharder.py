@@ -0,0 +1,110 @@
+# Runs the dieharder battery over a raw binary capture with one test per core at a time.
+#
+# Usage: python paralleldieharder.py [-j jobs] [-d tests] [-k ks] [-Y y] capture.bin > report.txt
+#
+# "dieharder -a" runs its tests one after another on one core, which takes hours. This
+# script asks dieharder for its list of tests and starts each one as its own
+# "dieharder -d n -g 201 -f capture.bin" (file_input_raw), jobs at a time (the number of
+# cores by default). The result lines are put back in test number order under one header,
+# in the format of geigersamples-output.txt. -d picks tests, eg. -d 0,1,15; -k and -Y are
+# passed on (2 and 1 by default, as in the README).
+#
+# Every test reads the capture from its start, as each one is a separate process. When a test
+# needs more than the capture holds, dieharder rewinds the file and the test sees the same
+# bytes again, so its p-value means little. Those tests are flagged after the table, with
+# the number of rewinds: use a longer capture, or leave them out.
+from __future__ import division, print_function
+
+import argparse
+import multiprocessing
+import re
+import subprocess
+import sys
+import time
+from multiprocessing.pool import ThreadPool
+
+FILE_INPUT_RAW = 201    # dieharder's generator number for a raw binary file
+
+def list_tests():
+    out = subprocess.check_output(['dieharder', '-l'], universal_newlines=True)
+    tests = []
+    for line in out.splitlines():
+        m = re.match(r'\s*-d\s+(\d+)\s', line)
+        if m:
+            tests.append(int(m.group(1)))
+    return tests
+
+def run_test(args):
+    test, capture, extra = args
+    start = time.time()
+    proc = subprocess.Popen(['dieharder', '-d', str(test), '-g', str(FILE_INPUT_RAW), '-f', capture] + extra,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    out = proc.communicate()[0]
+    return test, proc.returncode, out, time.time() - start
+
+ROW = re.compile(r'^\s*\w+\|\s*\d+\|')    # a result line, "   diehard_birthdays|   0|..."
+
+def parse(out):
+    """Split one dieharder run into its header, result lines and rewind count."""
+    header, rows, rewinds = [], [], 0
+    for line in out.splitlines():
+        m = re.search(r'rewound (\d+) times', line)
+        if m:
+            rewinds = int(m.group(1))
+        elif ROW.match(line):
+            rows.append(line)
+        elif not rows and not line.startswith('Preparing'):
+            header.append(line)
+    return header, rows, rewinds
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the dieharder tests in parallel over a raw capture.')
+    parser.add_argument('-j', type=int, default=multiprocessing.cpu_count(), help='tests run at a time')
+    parser.add_argument('-d', help='comma separated test numbers, all by default')
+    parser.add_argument('-k', default='2', help='dieharder -k')
+    parser.add_argument('-Y', default='1', help='dieharder -Y')
+    parser.add_argument('capture')
+    args = parser.parse_args()
+
+    tests = sorted(set(int(t) for t in args.d.split(','))) if args.d else list_tests()
+    if not tests:
+        sys.exit('dieharder -l listed no tests')
+    extra = ['-k', args.k, '-Y', args.Y]
+
+    start = time.time()
+    pool = ThreadPool(max(1, args.j))
+    results = {}
+    busy = 0.0
+    for test, status, out, seconds in pool.imap_unordered(run_test, [(t, args.capture, extra) for t in tests]):
+        if status != 0:
+            sys.exit('dieharder -d %d failed:\n%s' % (test, out))
+        results[test] = parse(out)
+        busy += seconds
+        print('test %d done in %.0f s' % (test, seconds), file=sys.stderr)
+    pool.close()
+
+    header_done = False
+    rewound = []
+    for test in tests:
+        header, rows, rewinds = results[test]
+        if not header_done:
+            for line in header:
+                print(line)
+            header_done = True
+        for line in rows:
+            print(line)
+        if rewinds:
+            name = rows[0].split('|')[0].strip() if rows else 'test %d' % test
+            rewound.append((test, name, rewinds))
+
+    if rewound:
+        print('#=============================================================================#')
+        print('# The capture was too short for these tests, they saw the same bytes again:  #')
+        for test, name, rewinds in rewound:
+            print('#   -d %-3d %-20s rewound %d times' % (test, name, rewinds))
+    wall = time.time() - start
+    print('%d tests in %.0f s, %.0f s of dieharder time on %d jobs' % (len(tests), wall, busy, args.j),
+          file=sys.stderr)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,70 @@
+# Decoder for the "#prof" lines of firmware built with PROFILE.
+#
+# Usage: python profdecode.py [-c] < putty.log
+#
+# Send "P" to the firmware to get a line; each one covers the time since the one before (or since
+# reset). For every line in the log this prints the options the firmware was built with and,
+# for each measurement, the count and the mean and maximum in microseconds:
+#
+#   int0 latency    Geiger edge to the start of the ISR, with input capture only
+#   int0            the Geiger ISR, start to end
+#   timer1 latency  Timer1 compare match to the start of ISR(TIMER1_COMPA_vect)
+#   timer1          ISR(TIMER1_COMPA_vect), start to end
+#   uart wait       time uart_putbyte() waited for the UART, per wait
+#
+# With -c the same is written as one comma separated line per record, for collecting the
+# numbers of many units in a spreadsheet.
+from __future__ import division, print_function
+
+import struct
+import sys
+
+VERSION = 1
+OPTIONS = ['GEIGER_ICP', 'FAST_INT0', 'DEFER_EXTRACT', 'PULSE_WIDTH', 'UART_TX_BUF_LEN', 'CONDITION',
+           'BEEP', 'INSTRUMENT', 'ADAPT', 'CHANGE_DETECT', 'RAW_EVENTS', 'CONTINUOUS',
+           'WDT_JITTER', 'RADLOG']
+STATS = ['int0 latency', 'int0', 'timer1 latency', 'timer1', 'uart wait']
+HEADER = struct.Struct('<BBHH')
+STAT = struct.Struct('<HHI')     # count, max, total in Timer1 ticks
+
+def decode(line):
+    """Return (parity_fold, options, [(count, mean_us, max_us)]) for a "#prof" line, or None."""
+    if not line.startswith('#prof '):
+        return None
+    try:
+        data = bytearray.fromhex(line[6:].strip())
+    except ValueError:
+        return None
+    if len(data) != HEADER.size + len(STATS) * STAT.size:
+        return None
+    version, fold, options, ticks_per_ms = HEADER.unpack_from(data)
+    if version != VERSION or ticks_per_ms == 0:
+        return None
+    us = 1000 / ticks_per_ms
+    stats = []
+    for i in range(len(STATS)):
+        count, peak, total = STAT.unpack_from(data, HEADER.size + i * STAT.size)
+        stats.append((count, total * us / count if count else 0.0, peak * us))
+    names = [name for bit, name in enumerate(OPTIONS) if options & (1 << bit)]
+    return fold, names, stats
+
+def main(input, csv):
+    if csv:
+        print('options,parity_fold,' + ','.join('%s count,%s mean us,%s max us' % (s, s, s) for s in STATS))
+    for line in input:
+        record = decode(line.strip())
+        if record is None:
+            continue
+        fold, options, stats = record
+        if csv:
+            print('%s,%d,%s' % (' '.join(options), fold,
+                                ','.join('%d,%.1f,%.1f' % s for s in stats)))
+            continue
+        print('options: %s, PARITY_FOLD %d' % (' '.join(options) or 'none', fold))
+        print('%-15s %8s %10s %10s' % ('', 'count', 'mean us', 'max us'))
+        for name, (count, mean, peak) in zip(STATS, stats):
+            print('%-15s %8d %10.1f %10.1f' % (name, count, mean, peak))
+        print()
+
+if __name__ == '__main__':
+    main(sys.stdin, '-c' in sys.argv[1:])
@@ -0,0 +1,136 @@
+# Decoder for the Golomb-Rice coded stream of the RAW_EVENTS + RAW_RICE firmware.
+#
+# Usage: python ricedecode.py [-u32] < capture.bin > capture.log
+#
+# By default the intervals are written as hex text, one per line, the same format the
+# hex RAW_EVENTS firmware sends, so the output can go straight into minentropy.py. Lost
+# events are written as "#lost". With -u32 the intervals are written as little endian
+# 32 bit integers instead and lost events are left out.
+#
+# The frames are decoded in the same order the firmware encoded them, since the Rice
+# parameter of each code depends on the ones before it. The work that doesn't depend on
+# that order is done with numpy for the whole capture at once: unpacking the bits,
+# finding where each run of 1s ends, and building a 64 bit window for every byte offset.
+# That leaves a few integer operations per code in the loop.
+#
+# Each frame header holds a sequence number and the exponent of the running mean, which
+# the decoder can predict from the frame before it. If the capture doesn't start at a
+# frame, or bytes were lost on the serial line, the headers stop matching. The decoder
+# then drops bytes until it finds SYNC_FRAMES frames in a row that match each other.
+from __future__ import division, print_function
+
+import sys
+import struct
+import numpy as np
+
+RICE_FRAME = 16     # must match GeigerRNG.c
+RICE_ESCAPE = 24
+SYNC_FRAMES = 3
+
+def log2_floor(x):
+    return x.bit_length() - 1 if x > 0 else 0
+
+class Stream(object):
+    def __init__(self, data):
+        raw = np.frombuffer(data, dtype=np.uint8)
+        bits = np.unpackbits(raw)
+        self.nbits = len(bits)
+        # next_zero[i] is the position of the first 0 bit at or after i
+        pos = np.where(bits == 0, np.arange(self.nbits), self.nbits)
+        self.next_zero = np.minimum.accumulate(pos[::-1])[::-1].tolist() + [self.nbits]
+        # window[b] holds bytes b..b+7 as a big endian 64 bit integer
+        padded = np.concatenate([raw, np.zeros(8, dtype=np.uint8)]).astype(np.uint64)
+        window = np.zeros(len(raw), dtype=np.uint64)
+        for i in range(8):
+            window = (window << np.uint64(8)) | padded[i:i+len(raw)]
+        self.window = window.tolist()
+
+    def take(self, pos, nbits):
+        """nbits (up to 32) starting at bit position pos"""
+        if nbits == 0:
+            return 0
+        w = self.window[pos >> 3]
+        return (w >> (64 - (pos & 7) - nbits)) & ((1 << nbits) - 1)
+
+def decode_frame(s, pos):
+    """Decode the frame at bit position pos.
+
+    Returns (header, intervals, next pos, expected header of the next frame) or None.
+    """
+    if pos + 8 > s.nbits:
+        return None
+    header = s.take(pos, 8)
+    pos += 8
+    seq = header >> 5
+    mean = 1 << (header & 31)
+    out = []
+    for _ in range(RICE_FRAME):
+        m = mean - (mean >> 2) - (mean >> 4)
+        k = log2_floor(m)
+        q = s.next_zero[pos] - pos
+        if q >= RICE_ESCAPE:
+            pos += RICE_ESCAPE
+            if pos + 32 > s.nbits:
+                return None
+            x = s.take(pos, 32)
+            pos += 32
+        else:
+            pos += q + 1
+            if pos + k > s.nbits:
+                return None
+            x = (q << k) | s.take(pos, k)
+            pos += k
+        if x != 0:
+            if x > mean:
+                mean += (x - mean) >> 4
+            else:
+                mean -= (mean - x) >> 4
+        out.append(x)
+    return header, out, (pos + 7) & ~7, (((seq + 1) & 7) << 5) | log2_floor(mean)
+
+def in_sync(s, frame):
+    """True if the SYNC_FRAMES - 1 frames after this one have the expected headers"""
+    for _ in range(SYNC_FRAMES - 1):
+        following = decode_frame(s, frame[2])
+        if following is None or following[0] != frame[3]:
+            return False
+        frame = following
+    return True
+
+def decode(data):
+    s = Stream(data)
+    pos = 0
+    expect = None
+    skipped = 0
+    while True:
+        frame = decode_frame(s, pos)
+        if frame is None:
+            break
+        header, intervals, nxt, following = frame
+        if header != expect and not in_sync(s, frame):
+            pos += 8
+            skipped += 1
+            expect = None
+            continue
+        for x in intervals:
+            yield x
+        expect = following
+        pos = nxt
+    if skipped:
+        sys.stderr.write('ricedecode: skipped %d bytes to stay in sync\n' % skipped)
+
+def main(input, output, u32):
+    data = input.read()
+    if u32:
+        for x in decode(data):
+            if x:
+                output.write(struct.pack('<I', x))
+    else:
+        for x in decode(data):
+            output.write(('%x\n' % x) if x else '#lost\n')
+
+if __name__ == '__main__':
+    u32 = '-u32' in sys.argv[1:]
+    stdin = getattr(sys.stdin, 'buffer', sys.stdin)
+    stdout = getattr(sys.stdout, 'buffer', sys.stdout) if u32 else sys.stdout
+    main(stdin, stdout, u32)
@@ -0,0 +1,348 @@
+/*
+	Title: simavr harness for the Geiger Counter Random Number Generator
+
+	Runs GeigerRNG.elf in simavr, feeds INT0 with Geiger pulses that have exponentially
+	distributed arrival times, copies the UART output to stdout and records the pins to
+	a VCD file that can be opened with GTKWave.
+
+	When the firmware is built with -DINSTRUMENT, the probe pins are high while the
+	instrumented code runs. The harness times every high phase in CPU cycles and prints
+	min/mean/max for each probe when the run ends, together with the latency from the
+	falling edge of a Geiger pulse to the moment ISR(INT0_vect) took its timestamp.
+
+	Usage: geigersim [-m mcu] [-f hz] [-c cpm] [-w pulse_us] [-j jitter_us] [-s seconds]
+	                 [-r seed] [-o file.vcd] [-S bytes] [-b] GeigerRNG.elf
+
+	-j gives the pulse width a normally distributed jitter, for testing PULSE_WIDTH builds.
+
+	-S acts as an SPI master for USI_SPI builds: every 100 ms it selects the firmware with
+	PB0, reads the status and count bytes and then up to the given number of random bytes
+	at 100 kHz. The random bytes are printed to stdout as hex, the status to stderr. This
+	needs a simavr that models the USI of the ATtiny2313.
+
+	-b presses the button once at startup, which is needed unless CONTINUOUS is defined.
+
+	Build with "make sim" from the top level directory.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "sim_vcd_file.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+
+// A pin that the firmware raises and lowers around a piece of code
+struct probe {
+	const char *name;
+	char port;
+	int pin;
+	avr_cycle_count_t rise;		// cycle of the last rising edge, 0 if low
+	unsigned long count;
+	avr_cycle_count_t min, max, sum;
+};
+
+// Keep in sync with the PROBE_* defines in GeigerRNG.c
+static struct probe probes[] = {
+	{ "INT0",		'D', 6 },
+	{ "TIMER1",		'D', 5 },
+	{ "sendreport",	'D', 4 },
+	{ "beep",		'B', 1 },
+	{ "sponge",		'B', 3 },
+};
+#define NPROBES (sizeof(probes) / sizeof(probes[0]))
+
+static avr_t *avr;
+static avr_irq_t *geiger_irq;		// PD2/INT0 (PB0/ICP1 on the ATmega328P), driven by us
+static char geiger_port = 'D';
+static int geiger_pin = 2;
+static avr_irq_t *button_irq;		// PD3/INT1, driven by us
+static double mean_us;				// mean interval between Geiger pulses
+static double pulse_us = 100.0;		// width of the (active low) Geiger pulse
+static double jitter_us;			// standard deviation of the pulse width
+static avr_cycle_count_t last_edge;	// cycle of the last falling edge on INT0
+static struct probe latency = { "edge->stamp" };
+static unsigned long pulses;
+
+// SPI master for USI_SPI builds
+#define SPI_HALF_BIT_US		5		// 100 kHz clock
+#define SPI_BYTE_GAP_US		20		// time for the slave to load the next byte
+#define SPI_PERIOD_US		100000	// time between transactions
+static int spi_max;					// bytes to read per transaction, 0 for none
+static avr_irq_t *ss_irq, *sck_irq, *mosi_irq;
+static uint32_t miso;
+static struct {
+	int active;
+	int edge;						// 0..15, even: rising edge, odd: falling edge
+	int index;						// byte in the transaction
+	int len;						// bytes in this transaction
+	uint8_t byte;
+	uint8_t buf[2 + 255];
+} spi;
+
+static void probe_add(struct probe *p, avr_cycle_count_t cycles)
+{
+	if (p->count == 0 || cycles < p->min)
+		p->min = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+	p->sum += cycles;
+	p->count++;
+}
+
+static void probe_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	struct probe *p = param;
+
+	if (value) {
+		p->rise = avr->cycle;
+		// INT0 probe rises right after TCNT1 was read
+		if (p == &probes[0] && last_edge) {
+			probe_add(&latency, avr->cycle - last_edge);
+			last_edge = 0;
+		}
+	} else if (p->rise) {
+		probe_add(p, avr->cycle - p->rise);
+		p->rise = 0;
+	}
+}
+
+static void uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	if (value != '\r')
+		putchar(value);
+}
+
+// End of a Geiger pulse, the input returns high
+static avr_cycle_count_t pulse_end(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	avr_raise_irq(geiger_irq, 1);
+	return 0;
+}
+
+// Start of a Geiger pulse, schedules the next one
+static avr_cycle_count_t pulse_start(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	double width_us = pulse_us;
+	double next_us;
+
+	avr_raise_irq(geiger_irq, 0);
+	last_edge = avr->cycle;
+	pulses++;
+	if (jitter_us > 0)	// Box-Muller
+		width_us += jitter_us * sqrt(-2.0 * log(1.0 - drand48())) * cos(2 * M_PI * drand48());
+	if (width_us < 1.0)
+		width_us = 1.0;
+	avr_cycle_timer_register_usec(avr, width_us, pulse_end, NULL);
+
+	// Dead time: the next pulse can't start before this one ended
+	do {
+		next_us = -log(1.0 - drand48()) * mean_us;
+	} while (next_us <= width_us);
+	return when + avr_usec_to_cycles(avr, next_us);
+}
+
+static void miso_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	miso = value;
+}
+
+static avr_cycle_count_t spi_step(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	int i;
+
+	if (!spi.active) {
+		spi.active = 1;
+		spi.edge = 0;
+		spi.index = 0;
+		spi.len = 2;
+		spi.byte = 0;
+		avr_raise_irq(ss_irq, 0);
+		return when + avr_usec_to_cycles(avr, SPI_BYTE_GAP_US);
+	}
+	if (spi.edge & 1) {
+		avr_raise_irq(sck_irq, 0);
+	} else {
+		// Mode 0: the slave's output is valid before the rising edge
+		spi.byte = (spi.byte << 1) | (miso & 1);
+		avr_raise_irq(sck_irq, 1);
+	}
+	if (++spi.edge < 16)
+		return when + avr_usec_to_cycles(avr, SPI_HALF_BIT_US);
+
+	spi.buf[spi.index++] = spi.byte;
+	spi.edge = 0;
+	spi.byte = 0;
+	if (spi.index == 2)
+		spi.len = 2 + (spi.buf[1] < spi_max ? spi.buf[1] : spi_max);
+	if (spi.index < spi.len)
+		return when + avr_usec_to_cycles(avr, SPI_BYTE_GAP_US);
+
+	avr_raise_irq(ss_irq, 1);
+	spi.active = 0;
+	fprintf(stderr, "SPI: status %02x, %d buffered, read %d\n", spi.buf[0], spi.buf[1], spi.len - 2);
+	for (i = 2; i < spi.len; i++)
+		printf("%02x", spi.buf[i]);
+	fflush(stdout);
+	return when + avr_usec_to_cycles(avr, SPI_PERIOD_US);
+}
+
+static avr_cycle_count_t button_release(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	avr_raise_irq(button_irq, 1);
+	return 0;
+}
+
+static avr_cycle_count_t button_press(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	avr_raise_irq(button_irq, 0);
+	avr_cycle_timer_register_usec(avr, 50000, button_release, NULL);
+	return 0;
+}
+
+static void print_probe(const struct probe *p)
+{
+	double us = 1e6 / avr->frequency;
+
+	if (p->count == 0) {
+		fprintf(stderr, "%-12s     no samples\n", p->name);
+		return;
+	}
+	fprintf(stderr, "%-12s %9lu %9llu %11.1f %9llu   %.2f/%.2f/%.2f us\n", p->name, p->count,
+			(unsigned long long)p->min, (double)p->sum / p->count, (unsigned long long)p->max,
+			p->min * us, p->sum * us / p->count, p->max * us);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: geigersim [-m mcu] [-f hz] [-c cpm] [-w pulse_us] [-j jitter_us] "
+			"[-s seconds] [-r seed] [-o file.vcd] [-S bytes] [-b] firmware.elf\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	elf_firmware_t f;
+	avr_vcd_t vcd;
+	const char *mmcu = "attiny2313";
+	const char *vcd_file = "GeigerRNG.vcd";
+	unsigned long frequency = 8000000;
+	double cpm = 600.0;
+	double seconds = 10.0;
+	int button = 0;
+	int state;
+	unsigned i;
+	uint32_t flags;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:f:c:w:j:s:r:o:S:b")) != -1) {
+		switch (c) {
+		case 'm': mmcu = optarg; break;
+		case 'f': frequency = strtoul(optarg, NULL, 0); break;
+		case 'c': cpm = atof(optarg); break;
+		case 'w': pulse_us = atof(optarg); break;
+		case 'j': jitter_us = atof(optarg); break;
+		case 's': seconds = atof(optarg); break;
+		case 'r': srand48(atol(optarg)); break;
+		case 'o': vcd_file = optarg; break;
+		case 'S': spi_max = atoi(optarg); break;
+		case 'b': button = 1; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || cpm <= 0 || spi_max < 0 || spi_max > 255)
+		usage();
+	mean_us = 60e6 / cpm;
+
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[optind], &f) != 0) {
+		fprintf(stderr, "geigersim: can't read %s\n", argv[optind]);
+		return 1;
+	}
+	strcpy(f.mmcu, mmcu);
+	f.frequency = frequency;
+
+	avr = avr_make_mcu_by_name(f.mmcu);
+	if (!avr) {
+		fprintf(stderr, "geigersim: unknown mcu %s\n", f.mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+
+	// UART goes to our stdout rather than simavr's log
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+			uart_output, NULL);
+
+	// On the ATmega328P pulses go to ICP1 and the PULSE pin moves to PD7 (see GeigerRNG.c)
+	if (strcmp(mmcu, "atmega328p") == 0) {
+		geiger_port = 'B';
+		geiger_pin = 0;
+		probes[0].pin = 7;
+	}
+	geiger_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(geiger_port), geiger_pin);
+	button_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 3);
+	avr_raise_irq(geiger_irq, 1);
+	avr_raise_irq(button_irq, 1);
+
+	avr_vcd_init(avr, vcd_file, &vcd, 1 /* usec */);
+	avr_vcd_add_signal(&vcd, geiger_irq, 1, "GEIGER");
+	avr_vcd_add_signal(&vcd, button_irq, 1, "BUTTON");
+	avr_vcd_add_signal(&vcd, avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4), 1, "LED");
+	for (i = 0; i < NPROBES; i++) {
+		avr_irq_t *irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(probes[i].port), probes[i].pin);
+		avr_irq_register_notify(irq, probe_changed, &probes[i]);
+		avr_vcd_add_signal(&vcd, irq, 1, probes[i].name);
+	}
+	if (spi_max) {
+		ss_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0);
+		mosi_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 5);
+		sck_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 7);
+		avr_raise_irq(ss_irq, 1);
+		avr_raise_irq(mosi_irq, 0);
+		avr_raise_irq(sck_irq, 0);
+		avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 6),
+				miso_changed, NULL);
+		avr_vcd_add_signal(&vcd, ss_irq, 1, "SS");
+		avr_vcd_add_signal(&vcd, sck_irq, 1, "SCK");
+		avr_vcd_add_signal(&vcd, avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 6), 1, "MISO");
+		avr_cycle_timer_register_usec(avr, SPI_PERIOD_US, spi_step, NULL);
+	}
+	avr_vcd_start(&vcd);
+
+	// Give the firmware time to initialize before anything happens
+	avr_cycle_timer_register_usec(avr, 10000, pulse_start, NULL);
+	if (button)
+		avr_cycle_timer_register_usec(avr, 10000, button_press, NULL);
+
+	do {
+		state = avr_run(avr);
+	} while (state != cpu_Done && state != cpu_Crashed &&
+			avr->cycle < (avr_cycle_count_t)(seconds * frequency));
+
+	avr_vcd_stop(&vcd);
+	fflush(stdout);
+
+	fprintf(stderr, "\n%lu Geiger pulses in %.1f s (%.0f CPM), waveforms in %s\n",
+			pulses, seconds, cpm, vcd_file);
+	fprintf(stderr, "%-12s %9s %9s %11s %9s   min/mean/max\n", "probe", "count", "min", "mean", "max");
+	print_probe(&latency);
+	for (i = 0; i < NPROBES; i++)
+		print_probe(&probes[i]);
+
+	return state == cpu_Crashed;
+}